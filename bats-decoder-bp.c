@@ -0,0 +1,1309 @@
+/*
+ * A belief-propagation (BP) BATS decoder. Received packets are saved per batch in echelon form.
+ * A batch is solved as soon as the rank of its received packets, restricted to the packets of the
+ * batch that are not decoded yet, equals the number of those packets. Decoded packets are then
+ * peeled out of the other batches and the parity-checks of the precode they are involved in, which
+ * may become solvable in turn. The decoding cost is linear in the number of packets.
+ *
+ * BP stalls before all packets can be decoded when no batch or parity-check is solvable on its own.
+ * The inactivation decoder then treats some undecoded packets as inactivated, i.e., as additional
+ * unknowns, so that peeling goes on with packets expressed in terms of the inactivated ones. The
+ * equations left unused by peeling form a small dense system of the inactivated packets, which is
+ * solved by Gaussian elimination. Peeling is first done on the coding coefficients only, and is
+ * repeated on the packet contents only once the dense system is of full rank. The coefficient-only
+ * attempt is kept between packets and updated with each of them while its dense system is small.
+ * The dense HDPC equations of the precode are never peeled by BP, only by inactivation decoding.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "bats.h"
+#include "galois.h"
+
+static struct bp_batch *get_batch(struct bats_decoder_bp *dec_ctx, BATSpacket *pkt);
+static int process_vector_batch(struct bats_decoder_bp *dec_ctx, struct bp_batch *batch, GF_ELEMENT *vector, GF_ELEMENT *message);
+static void check_batch(struct bats_decoder_bp *dec_ctx, struct bp_batch *batch);
+static int batch_rank(struct bats_decoder_bp *dec_ctx, struct bp_batch *batch, int ncol);
+static void solve_batch(struct bats_decoder_bp *dec_ctx, struct bp_batch *batch, int ncol);
+static void solve_check(struct bats_decoder_bp *dec_ctx, int c);
+static void decode_packet(struct bats_decoder_bp *dec_ctx, int id, GF_ELEMENT *data);
+static void propagate(struct bats_decoder_bp *dec_ctx);
+static void free_batch_rows(struct bp_batch *batch);
+static void free_batch(struct bp_batch *batch);
+static void count_unknown(struct bats_decoder_bp *dec_ctx);
+static int matrix_rank(struct bats_decoder_bp *dec_ctx, int nrow, int ncol, GF_ELEMENT A[nrow][ncol]);
+static void try_inactivation(struct bats_decoder_bp *dec_ctx, int b);
+static int inactivation_decode(struct bats_decoder_bp *dec_ctx);
+static void inac_free(struct bats_decoder_bp *dec_ctx, struct inac_state *st);
+static void release_packets(struct bats_decoder_bp *dec_ctx);
+
+extern void init_genrand(unsigned long s);
+extern long long forward_substitute(int nrow, int ncolA, int ncolB, GF_ELEMENT **A, GF_ELEMENT **B);
+extern long long back_substitute(int nrow, int ncolA, int ncolB, GF_ELEMENT *A[], GF_ELEMENT *B[]);
+
+struct bats_decoder_bp *bats_create_decoder_bp(BATSparam *param)
+{
+    static char fname[] = "bats_create_decoder_bp";
+    struct bats_decoder_bp *dctx = calloc(1, sizeof(struct bats_decoder_bp));
+    if (dctx == NULL) {
+        fprintf(stderr, "%s: calloc decoder context failed\n", fname);
+        return NULL;
+    }
+    dctx->param = param;
+    int numpp = param->snum + param->cnum + param->hnum;
+    // replicate the precode bipartite graph at the decoder side
+    // init mt19937 RNG
+    init_genrand(param->seed);
+    // create bipartite graph
+    if (param->cnum != 0) {
+        if ( (dctx->graph = acquire_bipartite_graph(param->snum, param->cnum, param->seed)) == NULL ) {
+            fprintf(stderr, "%s: create BP_graph failed\n", fname);
+            goto AllocError;
+        }
+    }
+    if (param->hnum != 0) {
+        if ( (dctx->hdpc = create_hdpc_matrix(param->hnum, param->snum+param->cnum, param->seed)) == NULL ) {
+            fprintf(stderr, "%s: create HDPC matrix failed\n", fname);
+            goto AllocError;
+        }
+    }
+    constructField();
+
+    dctx->pp = calloc(numpp, sizeof(GF_ELEMENT*));
+    dctx->known = calloc(numpp, sizeof(char));
+    dctx->nbat_of = calloc(numpp, sizeof(int));
+    dctx->bat_of_size = calloc(numpp, sizeof(int));
+    dctx->bat_of = calloc(numpp, sizeof(int*));
+    dctx->queue = calloc(numpp, sizeof(int));
+    if (dctx->pp == NULL || dctx->known == NULL || dctx->nbat_of == NULL || dctx->bat_of_size == NULL || dctx->bat_of == NULL || dctx->queue == NULL) {
+        fprintf(stderr, "%s: calloc packet states failed\n", fname);
+        goto AllocError;
+    }
+    if (param->cnum != 0) {
+        if ((dctx->unknown = calloc(param->cnum, sizeof(int))) == NULL) {
+            fprintf(stderr, "%s: calloc dctx->unknown failed\n", fname);
+            goto AllocError;
+        }
+        count_unknown(dctx);
+    }
+    return dctx;
+
+AllocError:
+    bats_free_decoder_bp(dctx);
+    return NULL;
+}
+
+struct bats_decoder_bp *bats_create_decoder_inac(BATSparam *param)
+{
+    struct bats_decoder_bp *dctx = bats_create_decoder_bp(param);
+    if (dctx != NULL)
+        dctx->inactivation = 1;
+    return dctx;
+}
+
+void bats_free_decoder_bp(struct bats_decoder_bp *decoder)
+{
+    if (decoder == NULL)
+        return;
+    int i;
+    int numpp = decoder->param->snum + decoder->param->cnum + decoder->param->hnum;
+    inac_free(decoder, decoder->inac);
+    if (decoder->batch != NULL) {
+        for (i=0; i<decoder->nbatch; i++)
+            free_batch(decoder->batch[i]);
+        free(decoder->batch);
+    }
+    for (i=0; i<numpp; i++) {
+        if (decoder->pp != NULL)
+            free(decoder->pp[i]);
+        if (decoder->bat_of != NULL)
+            free(decoder->bat_of[i]);
+    }
+    free(decoder->pp);
+    free(decoder->known);
+    free(decoder->bat_of);
+    free(decoder->bat_of_size);
+    free(decoder->nbat_of);
+    free(decoder->unknown);
+    free(decoder->queue);
+    release_bipartite_graph(decoder->graph);
+    free(decoder->hdpc);
+    free(decoder);
+}
+
+// Restore the decoder as just created for another transfer. The precode and the arrays of the
+// packets are kept, while the batches and the decoded packets are freed.
+void bats_reset_decoder_bp(struct bats_decoder_bp *decoder)
+{
+    int i;
+    int numpp = decoder->param->snum + decoder->param->cnum + decoder->param->hnum;
+    inac_free(decoder, decoder->inac);
+    decoder->inac = NULL;
+    decoder->inac_next = 0;
+    decoder->inactivated = 0;
+    for (i=0; i<decoder->nbatch; i++) {
+        free_batch(decoder->batch[i]);
+        decoder->batch[i] = NULL;
+    }
+    for (i=0; i<numpp; i++) {
+        free(decoder->pp[i]);
+        decoder->pp[i] = NULL;
+    }
+    memset(decoder->known, 0, numpp*sizeof(char));
+    memset(decoder->nbat_of, 0, numpp*sizeof(int));
+    if (decoder->unknown != NULL)
+        count_unknown(decoder);
+    decoder->qhead = 0;
+    decoder->qtail = 0;
+    decoder->received = 0;
+    decoder->overhead = 0;
+    decoder->DoF = 0;
+    decoder->decoded = 0;
+    decoder->finished = 0;
+    decoder->operations = 0;
+    decoder->released = 0;
+}
+
+// Every parity-check initially has all of its packets unknown
+static void count_unknown(struct bats_decoder_bp *dec_ctx)
+{
+    BP_graph *graph = dec_ctx->graph;
+    for (int c=0; c<dec_ctx->param->cnum; c++)
+        dec_ctx->unknown[c] = 1 + graph->l_of_r_off[c+1] - graph->l_of_r_off[c];
+}
+
+// process received BATS packet
+int bats_process_packet_bp(struct bats_decoder_bp *dec_ctx, BATSpacket *pkt)
+{
+    if (pkt == NULL || dec_ctx->finished)
+        return 0;
+
+    dec_ctx->received += 1;
+    dec_ctx->overhead += 1;
+
+    struct bp_batch *batch = get_batch(dec_ctx, pkt);
+    if (batch == NULL || batch->solved)
+        return 0;           // nothing new can be learned from the packet
+
+    // Process the packet against the received packets of the same batch
+    if (process_vector_batch(dec_ctx, batch, pkt->coes, pkt->syms) < 0)
+        return 0;           // not an innovative packet
+    dec_ctx->DoF += 1;
+
+    check_batch(dec_ctx, batch);
+    propagate(dec_ctx);
+
+    if (dec_ctx->inactivation)
+        try_inactivation(dec_ctx, pkt->batchid);
+    release_packets(dec_ctx);
+    return 1;
+}
+
+void bats_set_delivery_bp(struct bats_decoder_bp *dec_ctx, void (*deliver)(void *arg, int id, GF_ELEMENT *pkt), void *arg)
+{
+    dec_ctx->deliver = deliver;
+    dec_ctx->deliver_arg = arg;
+}
+
+// Common decoder interface
+static int bp_process(void *dec, BATSpacket *pkt)
+{
+    return bats_process_packet_bp(dec, pkt);
+}
+
+static int bp_finished(void *dec)
+{
+    return ((struct bats_decoder_bp *) dec)->finished;
+}
+
+// DoF within the batches may exceed the number of packets, while the rank of the received
+// packets can't
+static int bp_DoF(void *dec)
+{
+    struct bats_decoder_bp *dec_ctx = dec;
+    int numpp = dec_ctx->param->snum + dec_ctx->param->cnum + dec_ctx->param->hnum;
+    return dec_ctx->DoF < numpp ? dec_ctx->DoF : numpp;
+}
+
+static void bp_reset(void *dec)
+{
+    bats_reset_decoder_bp(dec);
+}
+
+static void bp_free(void *dec)
+{
+    bats_free_decoder_bp(dec);
+}
+
+static int bp_overhead(void *dec)
+{
+    return ((struct bats_decoder_bp *) dec)->overhead;
+}
+
+static long long bp_operations(void *dec)
+{
+    return ((struct bats_decoder_bp *) dec)->operations;
+}
+
+static GF_ELEMENT **bp_packets(void *dec)
+{
+    return ((struct bats_decoder_bp *) dec)->pp;
+}
+
+const struct bats_decoder_ops bats_decoder_bp_ops = {
+    bp_process, bp_finished, bp_DoF, bp_reset,
+    bp_free, bp_overhead, bp_operations, bp_packets,
+};
+
+// Release decoded source packets in order
+static void release_packets(struct bats_decoder_bp *dec_ctx)
+{
+    while (dec_ctx->released < dec_ctx->param->snum && dec_ctx->known[dec_ctx->released]) {
+        if (dec_ctx->deliver != NULL)
+            dec_ctx->deliver(dec_ctx->deliver_arg, dec_ctx->released, dec_ctx->pp[dec_ctx->released]);
+        dec_ctx->released += 1;
+    }
+}
+
+// Look up the batch of the packet, or set it up if it's the first packet of the batch
+static struct bp_batch *get_batch(struct bats_decoder_bp *dec_ctx, BATSpacket *pkt)
+{
+    static char fname[] = "get_batch";
+    int i;
+    int bid = pkt->batchid;
+    if (bid >= dec_ctx->nbatch) {
+        int nbatch = dec_ctx->nbatch == 0 ? 64 : dec_ctx->nbatch;
+        while (nbatch <= bid)
+            nbatch *= 2;
+        struct bp_batch **batch = realloc(dec_ctx->batch, nbatch*sizeof(struct bp_batch*));
+        if (batch == NULL) {
+            fprintf(stderr, "%s: realloc dec_ctx->batch failed\n", fname);
+            return NULL;
+        }
+        for (i=dec_ctx->nbatch; i<nbatch; i++)
+            batch[i] = NULL;
+        dec_ctx->batch = batch;
+        dec_ctx->nbatch = nbatch;
+    }
+    if (dec_ctx->batch[bid] != NULL)
+        return dec_ctx->batch[bid];
+
+    struct bp_batch *batch = calloc(1, sizeof(struct bp_batch));
+    if (batch == NULL) {
+        fprintf(stderr, "%s: calloc batch %d failed\n", fname, bid);
+        return NULL;
+    }
+    batch->degree = pkt->degree;
+    batch->pktid  = malloc(pkt->degree*sizeof(int));
+    batch->pivrow = malloc(pkt->degree*sizeof(int));
+    batch->row    = calloc(pkt->degree, sizeof(GF_ELEMENT*));
+    batch->msg    = calloc(pkt->degree, sizeof(GF_ELEMENT*));
+    memcpy(batch->pktid, pkt->pktid, pkt->degree*sizeof(int));
+    for (i=0; i<pkt->degree; i++)
+        batch->pivrow[i] = -1;
+    // register the batch at its undecoded packets
+    for (i=0; i<pkt->degree; i++) {
+        int id = pkt->pktid[i];
+        if (dec_ctx->known[id])
+            continue;
+        batch->undecoded += 1;
+        if (dec_ctx->nbat_of[id] == dec_ctx->bat_of_size[id]) {
+            int size = dec_ctx->bat_of_size[id] == 0 ? 4 : 2*dec_ctx->bat_of_size[id];
+            int *bat_of = realloc(dec_ctx->bat_of[id], size*sizeof(int));
+            if (bat_of == NULL) {
+                fprintf(stderr, "%s: realloc dec_ctx->bat_of[%d] failed\n", fname, id);
+                return NULL;
+            }
+            dec_ctx->bat_of[id] = bat_of;
+            dec_ctx->bat_of_size[id] = size;
+        }
+        dec_ctx->bat_of[id][dec_ctx->nbat_of[id]++] = bid;
+    }
+    if (batch->undecoded == 0)
+        batch->solved = 1;
+    dec_ctx->batch[bid] = batch;
+    return batch;
+}
+
+// Process a received vector against the received vectors of the same batch. Return the
+// position of its leading coefficient if the vector is innovative, or -1 otherwise.
+static int process_vector_batch(struct bats_decoder_bp *dec_ctx, struct bp_batch *batch, GF_ELEMENT *vector, GF_ELEMENT *message)
+{
+    static char fname[] = "process_vector_batch";
+    int i;
+    int pktsize = dec_ctx->param->pktsize;
+    int pivot = -1;
+    GF_ELEMENT quotient;
+
+    for (i=0; i<batch->degree; i++) {
+        if (vector[i] == 0)
+            continue;
+        int r = batch->pivrow[i];
+        if (r < 0) {
+            pivot = i;
+            break;
+        }
+        quotient = galois_divide(vector[i], batch->row[r][i]);
+        galois_multiply_add_region(&(vector[i]), &(batch->row[r][i]), quotient, batch->degree-i);
+        galois_multiply_add_region(message, batch->msg[r], quotient, pktsize);
+        dec_ctx->operations += 1 + batch->degree - i + pktsize;
+    }
+    if (pivot < 0)
+        return -1;
+
+    int r = batch->nrow;
+    batch->row[r] = malloc(batch->degree*sizeof(GF_ELEMENT));
+    batch->msg[r] = malloc(pktsize*sizeof(GF_ELEMENT));
+    if (batch->row[r] == NULL || (batch->msg[r] == NULL && pktsize != 0)) {
+        fprintf(stderr, "%s: malloc received packet failed\n", fname);
+        return -1;
+    }
+    memcpy(batch->row[r], vector, batch->degree*sizeof(GF_ELEMENT));
+    memcpy(batch->msg[r], message, pktsize*sizeof(GF_ELEMENT));
+    batch->pivrow[pivot] = r;
+    batch->nrow += 1;
+    return pivot;
+}
+
+// Solve the batch if its received packets are sufficient to decode its undecoded packets
+static void check_batch(struct bats_decoder_bp *dec_ctx, struct bp_batch *batch)
+{
+    if (batch->solved || batch->nrow < batch->undecoded)
+        return;
+    // packets decoded but not propagated yet are already known
+    int ncol = 0;
+    for (int j=0; j<batch->degree; j++) {
+        if (!dec_ctx->known[batch->pktid[j]])
+            ncol += 1;
+    }
+    if (ncol == 0) {
+        batch->solved = 1;
+        free_batch_rows(batch);
+        return;
+    }
+    if (batch_rank(dec_ctx, batch, ncol) == ncol)
+        solve_batch(dec_ctx, batch, ncol);
+}
+
+// Rank of the coding coefficients of the received packets restricted to the undecoded packets
+static int batch_rank(struct bats_decoder_bp *dec_ctx, struct bp_batch *batch, int ncol)
+{
+    int i, j, k;
+    int nrow = batch->nrow;
+    GF_ELEMENT A[nrow][ncol];
+    for (i=0; i<nrow; i++) {
+        for (j=0, k=0; j<batch->degree; j++) {
+            if (!dec_ctx->known[batch->pktid[j]])
+                A[i][k++] = batch->row[i][j];
+        }
+    }
+    return matrix_rank(dec_ctx, nrow, ncol, A);
+}
+
+// Rank of a matrix, which is reduced to echelon form in place
+static int matrix_rank(struct bats_decoder_bp *dec_ctx, int nrow, int ncol, GF_ELEMENT A[nrow][ncol])
+{
+    int i, j, k;
+    int rank = 0;
+    for (j=0; j<ncol && rank<nrow; j++) {
+        for (i=rank; i<nrow && A[i][j]==0; i++)
+            ;
+        if (i == nrow)
+            continue;
+        if (i != rank) {
+            for (k=j; k<ncol; k++) {
+                GF_ELEMENT tmp = A[i][k];
+                A[i][k] = A[rank][k];
+                A[rank][k] = tmp;
+            }
+        }
+        for (i=rank+1; i<nrow; i++) {
+            if (A[i][j] == 0)
+                continue;
+            GF_ELEMENT quotient = galois_divide(A[i][j], A[rank][j]);
+            galois_multiply_add_region(&(A[i][j]), &(A[rank][j]), quotient, ncol-j);
+            dec_ctx->operations += 1 + ncol - j;
+        }
+        rank += 1;
+    }
+    return rank;
+}
+
+// Decode the undecoded packets of the batch, of which the rank condition is met
+static void solve_batch(struct bats_decoder_bp *dec_ctx, struct bp_batch *batch, int ncol)
+{
+    static char fname[] = "solve_batch";
+    int i, j, k;
+    int pktsize = dec_ctx->param->pktsize;
+    int nrow = batch->nrow;
+    int ids[ncol];
+    GF_ELEMENT *A[nrow];
+    for (i=0; i<nrow; i++) {
+        if ((A[i] = calloc(ncol, sizeof(GF_ELEMENT))) == NULL) {
+            fprintf(stderr, "%s: calloc coefficient matrix failed\n", fname);
+            while (i-- > 0)
+                free(A[i]);
+            return;         // the batch is left for a later packet to solve
+        }
+    }
+    for (i=0; i<nrow; i++) {
+        for (j=0, k=0; j<batch->degree; j++) {
+            int id = batch->pktid[j];
+            GF_ELEMENT ce = batch->row[i][j];
+            if (!dec_ctx->known[id]) {
+                ids[k] = id;
+                A[i][k++] = ce;
+            } else if (ce != 0) {
+                // move contribution of the decoded packet to the right-hand side
+                galois_multiply_add_region(batch->msg[i], dec_ctx->pp[id], ce, pktsize);
+                dec_ctx->operations += 1 + pktsize;
+            }
+        }
+    }
+    dec_ctx->operations += forward_substitute(nrow, ncol, pktsize, A, batch->msg);
+    dec_ctx->operations += back_substitute(ncol, ncol, pktsize, A, batch->msg);
+    batch->solved = 1;
+    for (i=0; i<ncol; i++) {
+        decode_packet(dec_ctx, ids[i], batch->msg[i]);
+        batch->msg[i] = NULL;   // now owned by dec_ctx->pp
+    }
+    for (i=0; i<nrow; i++)
+        free(A[i]);
+    free_batch_rows(batch);
+}
+
+// Decode the only undecoded packet of a parity-check
+static void solve_check(struct bats_decoder_bp *dec_ctx, int c)
+{
+    static char fname[] = "solve_check";
+    int pktsize = dec_ctx->param->pktsize;
+    int id = dec_ctx->param->snum + c;      // parity-check packet has coefficient 1
+    GF_ELEMENT ce = 1;
+    // packets decoded but not propagated yet are already known
+    int unknown = dec_ctx->known[id] ? 0 : 1;
+    BP_graph *graph = dec_ctx->graph;
+    int e;
+    for (e=graph->l_of_r_off[c]; e<graph->l_of_r_off[c+1]; e++) {
+        if (!dec_ctx->known[graph->l_of_r_idx[e]])
+            unknown += 1;
+    }
+    if (unknown != 1)
+        return;
+    GF_ELEMENT *data = NULL;
+    if (pktsize != 0 && (data = calloc(pktsize, sizeof(GF_ELEMENT))) == NULL) {
+        fprintf(stderr, "%s: calloc packet %d failed\n", fname, id);
+        return;
+    }
+    if (dec_ctx->known[id])
+        galois_multiply_add_region(data, dec_ctx->pp[id], 1, pktsize);
+    for (e=graph->l_of_r_off[c]; e<graph->l_of_r_off[c+1]; e++) {
+        int sid = graph->l_of_r_idx[e];
+        if (!dec_ctx->known[sid]) {
+            id = sid;
+            ce = graph->l_of_r_ce[e];
+        } else {
+            galois_multiply_add_region(data, dec_ctx->pp[sid], graph->l_of_r_ce[e], pktsize);
+            dec_ctx->operations += 1 + pktsize;
+        }
+    }
+    if (ce != 1) {
+        galois_multiply_region(data, galois_divide(1, ce), pktsize);
+        dec_ctx->operations += 1 + pktsize;
+    }
+    decode_packet(dec_ctx, id, data);
+}
+
+static void decode_packet(struct bats_decoder_bp *dec_ctx, int id, GF_ELEMENT *data)
+{
+    dec_ctx->pp[id] = data;
+    dec_ctx->known[id] = 1;
+    if (id < dec_ctx->param->snum)
+        dec_ctx->decoded += 1;
+    dec_ctx->queue[dec_ctx->qtail++] = id;
+}
+
+// Peel newly decoded packets out of the batches and parity-checks they are involved in
+static void propagate(struct bats_decoder_bp *dec_ctx)
+{
+    int k;
+    int snum = dec_ctx->param->snum;
+    while (dec_ctx->qhead < dec_ctx->qtail) {
+        int id = dec_ctx->queue[dec_ctx->qhead++];
+        for (k=0; k<dec_ctx->nbat_of[id]; k++) {
+            struct bp_batch *batch = dec_ctx->batch[dec_ctx->bat_of[id][k]];
+            batch->undecoded -= 1;
+            check_batch(dec_ctx, batch);
+        }
+        if (dec_ctx->graph == NULL || id >= snum + dec_ctx->param->cnum)
+            continue;           // HDPC packets are not involved in parity-checks
+        if (id >= snum) {
+            if (--dec_ctx->unknown[id-snum] == 1)
+                solve_check(dec_ctx, id-snum);
+        } else {
+            BP_graph *graph = dec_ctx->graph;
+            for (int e=graph->r_of_l_off[id]; e<graph->r_of_l_off[id+1]; e++) {
+                if (--dec_ctx->unknown[graph->r_of_l_idx[e]] == 1)
+                    solve_check(dec_ctx, graph->r_of_l_idx[e]);
+            }
+        }
+    }
+    if (dec_ctx->decoded == snum)
+        dec_ctx->finished = 1;
+}
+
+static void free_batch_rows(struct bp_batch *batch)
+{
+    for (int i=0; i<batch->degree; i++) {
+        free(batch->row[i]);
+        free(batch->msg[i]);
+        batch->row[i] = NULL;
+        batch->msg[i] = NULL;
+    }
+    batch->nrow = 0;
+}
+
+static void free_batch(struct bp_batch *batch)
+{
+    if (batch == NULL)
+        return;
+    free_batch_rows(batch);
+    free(batch->pktid);
+    free(batch->pivrow);
+    free(batch->row);
+    free(batch->msg);
+    free(batch);
+}
+
+/*
+ * Inactivation decoding
+ */
+#define INAC_KEEP   64      // largest number of inactivated packets of an attempt kept between packets
+
+// Value of a packet during inactivation decoding: a linear combination of the inactivated
+// packets plus a constant part
+struct inac_value {
+    int                 len;                // number of inactivated packets involved
+    GF_ELEMENT          *ce;                // coefficients of the inactivated packets
+    GF_ELEMENT          *data;              // constant part, NULL if zero
+};
+
+struct inac_state {
+    int                 probe;              // whether only the rank is tracked, on the coding coefficients
+    int                 pktsize;            // size of the constant parts, 0 if probing or simulating ranks only
+    char                *known;             // 0: unknown; 1: resolved by peeling or inactivated; 2: decoded by BP
+    struct inac_value   *val;               // values of the known packets
+    int                 unknown;            // number of unknown packets
+    int                 seen;               // packets decoded by BP taken into account, i.e., dec_ctx->queue[0, seen)
+    int                 nbatch;             // size of the batch states below
+    int                 *bunk;              // number of unknown packets of each batch, -1 if not set up yet
+    int                 *bdone;             // number of received packets of each batch used so far
+    char                *bused;             // whether the batch has been used for peeling
+    int                 *cunk;              // number of unknown packets of each parity-check
+    char                *cused;             // whether the parity-check has been used for peeling
+    int                 *hunk;              // number of unknown packets of each HDPC equation
+    char                *hused;             // whether the HDPC equation has been used for peeling
+    int                 *queue;             // newly known packets whose neighbours are to be updated
+    int                 qhead;
+    int                 qtail;
+    int                 ninact;             // number of inactivated packets
+    int                 inact_size;         // allocated size of pivot
+    int                 *pivot;             // probing only: core equation led by each inactivated packet, -1 if none
+    int                 ncore;              // number of equations of the inactivated packets
+    int                 core_size;          // allocated size of core
+    struct inac_value   *core;              // equations of the inactivated packets, i.e., ce * x = data
+};
+
+static struct inac_state *inac_create(struct bats_decoder_bp *dec_ctx, int probe);
+static int inac_update(struct bats_decoder_bp *dec_ctx, struct inac_state *st, int b);
+static void value_extend(struct inac_value *v, int len);
+static void value_add(struct bats_decoder_bp *dec_ctx, struct inac_value *dst, struct inac_value *src, GF_ELEMENT c, int pktsize);
+static void value_scale(struct bats_decoder_bp *dec_ctx, struct inac_value *v, GF_ELEMENT c, int pktsize);
+static void inac_known(struct inac_state *st, int id);
+static void inac_inactivate(struct inac_state *st, int id);
+static void inac_sync_batch(struct bats_decoder_bp *dec_ctx, struct inac_state *st, int b);
+static void inac_batch_row(struct bats_decoder_bp *dec_ctx, struct inac_state *st, struct bp_batch *batch, int r);
+static void inac_batch(struct bats_decoder_bp *dec_ctx, struct inac_state *st, int b);
+static void inac_check(struct bats_decoder_bp *dec_ctx, struct inac_state *st, int c);
+static void inac_hdpc(struct bats_decoder_bp *dec_ctx, struct inac_state *st, int h);
+static void inac_propagate(struct bats_decoder_bp *dec_ctx, struct inac_state *st);
+static int inac_choose(struct bats_decoder_bp *dec_ctx, struct inac_state *st);
+static void inac_add_core(struct bats_decoder_bp *dec_ctx, struct inac_state *st, struct inac_value *v);
+static int inac_solve_core(struct bats_decoder_bp *dec_ctx, struct inac_state *st);
+
+// Track the rank of the received equations by inactivation on the coding coefficients. The attempt
+// is updated with each innovative packet (of batch b) as long as it has few inactivated packets.
+// Otherwise it's dropped, and as each packet adds at most 1 to the rank, no new attempt is made
+// before the DoF gained since make up for its rank deficiency.
+static void try_inactivation(struct bats_decoder_bp *dec_ctx, int b)
+{
+    BATSparam *param = dec_ctx->param;
+    int numpp = param->snum + param->cnum + param->hnum;
+    if (dec_ctx->finished) {
+        inac_free(dec_ctx, dec_ctx->inac);
+        dec_ctx->inac = NULL;
+        return;
+    }
+    if (dec_ctx->inac == NULL) {
+        // there might not be enough equations for all packets yet
+        if (dec_ctx->DoF + param->cnum + param->hnum < numpp || dec_ctx->DoF < dec_ctx->inac_next)
+            return;
+        if ((dec_ctx->inac = inac_create(dec_ctx, 1)) == NULL)
+            return;
+        b = -1;             // all received packets are new to the attempt
+    }
+    struct inac_state *st = dec_ctx->inac;
+    if (inac_update(dec_ctx, st, b) < 0) {
+        inac_free(dec_ctx, st);
+        dec_ctx->inac = NULL;
+        return;
+    }
+    // packets neither determined by peeling nor by the equations of the inactivated packets
+    int deficiency = st->unknown + st->ninact - st->ncore;
+    if (deficiency == 0)
+        inactivation_decode(dec_ctx);
+    if (deficiency == 0 || st->ninact > INAC_KEEP) {
+        inac_free(dec_ctx, st);
+        dec_ctx->inac = NULL;
+        dec_ctx->inac_next = dec_ctx->DoF + deficiency;
+    }
+}
+
+// Try to decode all the packets by inactivation from scratch, with their contents unless only
+// ranks are simulated. Return 1 if the packets are decoded, 0 otherwise.
+static int inactivation_decode(struct bats_decoder_bp *dec_ctx)
+{
+    int decodable = 0;
+    struct inac_state *st = inac_create(dec_ctx, 0);
+    if (st == NULL || inac_update(dec_ctx, st, -1) < 0)
+        goto Release;
+    decodable = inac_solve_core(dec_ctx, st);
+    if (decodable) {
+        dec_ctx->inactivated = st->ninact;
+        dec_ctx->finished = 1;
+    }
+
+Release:
+    inac_free(dec_ctx, st);
+    return decodable;
+}
+
+// Set up an attempt with all packets unknown. A probing attempt only tracks the rank of the
+// received equations, while the other one decodes the packets.
+static struct inac_state *inac_create(struct bats_decoder_bp *dec_ctx, int probe)
+{
+    static char fname[] = "inac_create";
+    int c, h, j;
+    int snum = dec_ctx->param->snum;
+    int cnum = dec_ctx->param->cnum;
+    int hnum = dec_ctx->param->hnum;
+    int ncol = snum + cnum;
+    int numpp = ncol + hnum;
+
+    struct inac_state *st = calloc(1, sizeof(struct inac_state));
+    if (st == NULL) {
+        fprintf(stderr, "%s: calloc inactivation state failed\n", fname);
+        return NULL;
+    }
+    st->probe = probe;
+    st->pktsize = probe ? 0 : dec_ctx->param->pktsize;
+    st->unknown = numpp;
+    st->known = calloc(numpp, sizeof(char));
+    st->val   = calloc(numpp, sizeof(struct inac_value));
+    st->queue = malloc(numpp*sizeof(int));
+    st->cunk  = calloc(cnum, sizeof(int));
+    st->cused = calloc(cnum, sizeof(char));
+    st->hunk  = calloc(hnum, sizeof(int));
+    st->hused = calloc(hnum, sizeof(char));
+    if (st->known == NULL || st->val == NULL || st->queue == NULL
+            || (cnum != 0 && (st->cunk == NULL || st->cused == NULL))
+            || (hnum != 0 && (st->hunk == NULL || st->hused == NULL))) {
+        fprintf(stderr, "%s: calloc inactivation states failed\n", fname);
+        inac_free(dec_ctx, st);
+        return NULL;
+    }
+    for (c=0; c<cnum; c++)
+        st->cunk[c] = 1 + dec_ctx->graph->l_of_r_off[c+1] - dec_ctx->graph->l_of_r_off[c];
+    for (h=0; h<hnum; h++) {
+        st->hunk[h] = 1;
+        for (j=0; j<ncol; j++)
+            st->hunk[h] += dec_ctx->hdpc[(size_t) h*ncol+j] != 0;
+    }
+    return st;
+}
+
+static void inac_free(struct bats_decoder_bp *dec_ctx, struct inac_state *st)
+{
+    if (st == NULL)
+        return;
+    int i;
+    int numpp = dec_ctx->param->snum + dec_ctx->param->cnum + dec_ctx->param->hnum;
+    if (st->val != NULL) {
+        for (i=0; i<numpp; i++) {
+            free(st->val[i].ce);
+            if (st->known[i] != 2)
+                free(st->val[i].data);
+        }
+    }
+    for (i=0; i<st->ncore; i++) {
+        free(st->core[i].ce);
+        free(st->core[i].data);
+    }
+    free(st->core);
+    free(st->pivot);
+    free(st->known);
+    free(st->val);
+    free(st->queue);
+    free(st->bunk);
+    free(st->bdone);
+    free(st->bused);
+    free(st->cunk);
+    free(st->cused);
+    free(st->hunk);
+    free(st->hused);
+    free(st);
+}
+
+// Bring the attempt up to date with the packets decoded by BP and the packets received from batch
+// b since the last update, or from all batches if b is -1. Peel, and inactivate a packet whenever
+// peeling stalls. Return 0 on success, -1 on failure.
+static int inac_update(struct bats_decoder_bp *dec_ctx, struct inac_state *st, int b)
+{
+    static char fname[] = "inac_update";
+    int i;
+    if (st->nbatch < dec_ctx->nbatch) {
+        int nbatch = dec_ctx->nbatch;
+        int *bunk = realloc(st->bunk, nbatch*sizeof(int));
+        if (bunk != NULL)
+            st->bunk = bunk;
+        int *bdone = realloc(st->bdone, nbatch*sizeof(int));
+        if (bdone != NULL)
+            st->bdone = bdone;
+        char *bused = realloc(st->bused, nbatch*sizeof(char));
+        if (bused != NULL)
+            st->bused = bused;
+        if (bunk == NULL || bdone == NULL || bused == NULL) {
+            fprintf(stderr, "%s: realloc batch states failed\n", fname);
+            return -1;
+        }
+        for (i=st->nbatch; i<nbatch; i++) {
+            st->bunk[i] = -1;
+            st->bdone[i] = 0;
+            st->bused[i] = 0;
+        }
+        st->nbatch = nbatch;
+    }
+
+    // Packets decoded by BP are known
+    while (st->seen < dec_ctx->qtail) {
+        int id = dec_ctx->queue[st->seen++];
+        struct inac_value pp = {0, NULL, st->pktsize != 0 ? dec_ctx->pp[id] : NULL};
+        if (st->known[id] == 0) {
+            st->val[id] = pp;
+            inac_known(st, id);
+            st->known[id] = 2;
+        } else if (st->known[id] == 1) {
+            // the value found by peeling turns into an equation of the inactivated packets
+            struct inac_value v = {0, NULL, NULL};
+            value_add(dec_ctx, &v, &st->val[id], 1, st->pktsize);
+            value_add(dec_ctx, &v, &pp, 1, st->pktsize);
+            inac_add_core(dec_ctx, st, &v);
+        }
+    }
+    inac_propagate(dec_ctx, st);
+
+    // Batches are set up after the known packets are propagated, so that none is counted twice
+    if (b >= 0) {
+        inac_sync_batch(dec_ctx, st, b);
+    } else {
+        for (b=0; b<st->nbatch; b++)
+            inac_sync_batch(dec_ctx, st, b);
+    }
+    inac_propagate(dec_ctx, st);
+    while (st->unknown > 0) {
+        int id = inac_choose(dec_ctx, st);
+        if (id < 0)
+            break;          // the remaining packets are not involved in any unused equation
+        inac_inactivate(st, id);
+        inac_propagate(dec_ctx, st);
+    }
+    return 0;
+}
+
+// Make room for the coefficients of the first len inactivated packets
+static void value_extend(struct inac_value *v, int len)
+{
+    if (len <= v->len)
+        return;
+    v->ce = realloc(v->ce, len*sizeof(GF_ELEMENT));
+    memset(&(v->ce[v->len]), 0, (len-v->len)*sizeof(GF_ELEMENT));
+    v->len = len;
+}
+
+// dst += c * src
+static void value_add(struct bats_decoder_bp *dec_ctx, struct inac_value *dst, struct inac_value *src, GF_ELEMENT c, int pktsize)
+{
+    if (c == 0)
+        return;
+    value_extend(dst, src->len);
+    galois_multiply_add_region(dst->ce, src->ce, c, src->len);
+    dec_ctx->operations += 1 + src->len;
+    if (pktsize != 0 && src->data != NULL) {
+        if (dst->data == NULL)
+            dst->data = calloc(pktsize, sizeof(GF_ELEMENT));
+        galois_multiply_add_region(dst->data, src->data, c, pktsize);
+        dec_ctx->operations += pktsize;
+    }
+}
+
+// v *= c
+static void value_scale(struct bats_decoder_bp *dec_ctx, struct inac_value *v, GF_ELEMENT c, int pktsize)
+{
+    if (c == 1)
+        return;
+    galois_multiply_region(v->ce, c, v->len);
+    dec_ctx->operations += 1 + v->len;
+    if (pktsize != 0 && v->data != NULL) {
+        galois_multiply_region(v->data, c, pktsize);
+        dec_ctx->operations += pktsize;
+    }
+}
+
+static void inac_known(struct inac_state *st, int id)
+{
+    st->known[id] = 1;
+    st->unknown -= 1;
+    st->queue[st->qtail++] = id;
+}
+
+static void inac_inactivate(struct inac_state *st, int id)
+{
+    int m = st->ninact++;
+    if (m == st->inact_size) {
+        st->inact_size = st->inact_size == 0 ? 64 : 2*st->inact_size;
+        st->pivot = realloc(st->pivot, st->inact_size*sizeof(int));
+    }
+    st->pivot[m] = -1;
+    st->val[id].len = m + 1;
+    st->val[id].ce  = calloc(m+1, sizeof(GF_ELEMENT));
+    st->val[id].ce[m] = 1;
+    inac_known(st, id);
+}
+
+// Take the packets received from the batch since the last update into account
+static void inac_sync_batch(struct bats_decoder_bp *dec_ctx, struct inac_state *st, int b)
+{
+    struct bp_batch *batch = dec_ctx->batch[b];
+    if (batch == NULL)
+        return;
+    if (st->bunk[b] < 0) {
+        st->bunk[b] = 0;
+        for (int i=0; i<batch->degree; i++)
+            st->bunk[b] += st->known[batch->pktid[i]] == 0;
+    }
+    if (!st->bused[b]) {
+        inac_batch(dec_ctx, st, b);
+        return;
+    }
+    // all packets of a used batch are known, so its new packets are equations of the inactivated packets
+    for (int r=st->bdone[b]; r<batch->nrow; r++)
+        inac_batch_row(dec_ctx, st, batch, r);
+    st->bdone[b] = batch->nrow;
+}
+
+// Turn a received packet of a batch whose packets are all known into an equation of the
+// inactivated packets
+static void inac_batch_row(struct bats_decoder_bp *dec_ctx, struct inac_state *st, struct bp_batch *batch, int r)
+{
+    int i;
+    for (i=0; i<batch->degree && st->known[batch->pktid[i]]==2; i++)
+        ;
+    if (i == batch->degree)
+        return;             // nothing to learn if all are decoded by BP
+    struct inac_value v = {0, NULL, NULL};
+    if (st->pktsize != 0) {
+        v.data = malloc(st->pktsize*sizeof(GF_ELEMENT));
+        memcpy(v.data, batch->msg[r], st->pktsize*sizeof(GF_ELEMENT));
+    }
+    for (i=0; i<batch->degree; i++)
+        value_add(dec_ctx, &v, &st->val[batch->pktid[i]], batch->row[r][i], st->pktsize);
+    inac_add_core(dec_ctx, st, &v);
+}
+
+// Resolve the unknown packets of the batch if its received packets are sufficient
+static void inac_batch(struct bats_decoder_bp *dec_ctx, struct inac_state *st, int b)
+{
+    int i, j, k;
+    struct bp_batch *batch = dec_ctx->batch[b];
+    if (st->bused[b] || st->bunk[b] < 0)
+        return;
+    if (batch->solved) {
+        // its packets are decoded by BP, of which the attempt is informed separately
+        st->bused[b] = 1;
+        return;
+    }
+    if (batch->nrow < st->bunk[b])
+        return;
+    // packets known but not propagated yet are not counted by bunk
+    int nrow = batch->nrow;
+    int ncol = 0;
+    for (j=0; j<batch->degree; j++)
+        ncol += st->known[batch->pktid[j]] == 0;
+    if (ncol == 0) {
+        for (i=0; i<nrow; i++)
+            inac_batch_row(dec_ctx, st, batch, i);
+        st->bused[b] = 1;
+        st->bdone[b] = nrow;
+        return;
+    }
+    int ids[ncol];
+    GF_ELEMENT A[nrow][ncol], T[nrow][ncol];
+    for (i=0; i<nrow; i++) {
+        for (j=0, k=0; j<batch->degree; j++) {
+            if (st->known[batch->pktid[j]] == 0) {
+                ids[k] = batch->pktid[j];
+                A[i][k++] = batch->row[i][j];
+            }
+        }
+    }
+    memcpy(T, A, sizeof(T));
+    if (matrix_rank(dec_ctx, nrow, ncol, T) < ncol)
+        return;
+
+    // Move the known packets to the right-hand side
+    struct inac_value V[nrow];
+    for (i=0; i<nrow; i++) {
+        V[i] = (struct inac_value) {0, NULL, NULL};
+        if (st->pktsize != 0) {
+            V[i].data = malloc(st->pktsize*sizeof(GF_ELEMENT));
+            memcpy(V[i].data, batch->msg[i], st->pktsize*sizeof(GF_ELEMENT));
+        }
+        for (j=0; j<batch->degree; j++) {
+            if (st->known[batch->pktid[j]] != 0)
+                value_add(dec_ctx, &V[i], &st->val[batch->pktid[j]], batch->row[i][j], st->pktsize);
+        }
+    }
+    // Gauss-Jordan elimination on the unknown packets
+    for (j=0; j<ncol; j++) {
+        for (i=j; A[i][j]==0; i++)
+            ;
+        if (i != j) {
+            for (k=0; k<ncol; k++) {
+                GF_ELEMENT tmp = A[i][k];
+                A[i][k] = A[j][k];
+                A[j][k] = tmp;
+            }
+            struct inac_value tmp = V[i];
+            V[i] = V[j];
+            V[j] = tmp;
+        }
+        for (i=0; i<nrow; i++) {
+            if (i == j || A[i][j] == 0)
+                continue;
+            GF_ELEMENT quotient = galois_divide(A[i][j], A[j][j]);
+            galois_multiply_add_region(A[i], A[j], quotient, ncol);
+            value_add(dec_ctx, &V[i], &V[j], quotient, st->pktsize);
+        }
+    }
+    st->bused[b] = 1;
+    st->bdone[b] = nrow;
+    for (j=0; j<ncol; j++) {
+        value_scale(dec_ctx, &V[j], galois_divide(1, A[j][j]), st->pktsize);
+        st->val[ids[j]] = V[j];
+        inac_known(st, ids[j]);
+    }
+    // the remaining received packets are equations of the inactivated packets
+    for (i=ncol; i<nrow; i++)
+        inac_add_core(dec_ctx, st, &V[i]);
+}
+
+// Resolve the only unknown packet of a parity-check, or turn the parity-check into an equation
+// of the inactivated packets if all of its packets are known
+static void inac_check(struct bats_decoder_bp *dec_ctx, struct inac_state *st, int c)
+{
+    if (st->cused[c] || st->cunk[c] > 1)
+        return;
+    int id = dec_ctx->param->snum + c;
+    GF_ELEMENT ce = 1;
+    // packets known but not propagated yet are not counted by cunk
+    int unknown = st->known[id] == 0;
+    int inactive = st->known[id] == 1;
+    BP_graph *graph = dec_ctx->graph;
+    int e;
+    for (e=graph->l_of_r_off[c]; e<graph->l_of_r_off[c+1]; e++) {
+        unknown += st->known[graph->l_of_r_idx[e]] == 0;
+        inactive += st->known[graph->l_of_r_idx[e]] == 1;
+    }
+    if (unknown > 1)
+        return;
+    st->cused[c] = 1;
+    if (unknown == 0 && inactive == 0)
+        return;             // nothing to learn if all are decoded by BP
+    struct inac_value v = {0, NULL, NULL};
+    if (st->known[id] != 0)
+        value_add(dec_ctx, &v, &st->val[id], 1, st->pktsize);
+    for (e=graph->l_of_r_off[c]; e<graph->l_of_r_off[c+1]; e++) {
+        int sid = graph->l_of_r_idx[e];
+        if (st->known[sid] == 0) {
+            id = sid;
+            ce = graph->l_of_r_ce[e];
+        } else {
+            value_add(dec_ctx, &v, &st->val[sid], graph->l_of_r_ce[e], st->pktsize);
+        }
+    }
+    if (unknown == 0) {
+        inac_add_core(dec_ctx, st, &v);
+        return;
+    }
+    value_scale(dec_ctx, &v, galois_divide(1, ce), st->pktsize);
+    st->val[id] = v;
+    inac_known(st, id);
+}
+
+// Resolve the only unknown packet of an HDPC equation, or turn the equation into an equation
+// of the inactivated packets if all of its packets are known
+static void inac_hdpc(struct bats_decoder_bp *dec_ctx, struct inac_state *st, int h)
+{
+    if (st->hused[h] || st->hunk[h] > 1)
+        return;
+    int ncol = dec_ctx->param->snum + dec_ctx->param->cnum;
+    GF_ELEMENT *row = &(dec_ctx->hdpc[(size_t) h*ncol]);
+    int id = ncol + h;      // HDPC packet has coefficient 1
+    GF_ELEMENT ce = 1;
+    // packets known but not propagated yet are not counted by hunk
+    int unknown = st->known[id] == 0;
+    int inactive = st->known[id] == 1;
+    int j;
+    for (j=0; j<ncol; j++) {
+        if (row[j] != 0) {
+            unknown += st->known[j] == 0;
+            inactive += st->known[j] == 1;
+        }
+    }
+    if (unknown > 1)
+        return;
+    st->hused[h] = 1;
+    if (unknown == 0 && inactive == 0)
+        return;             // nothing to learn if all are decoded by BP
+    struct inac_value v = {0, NULL, NULL};
+    if (st->known[id] != 0)
+        value_add(dec_ctx, &v, &st->val[id], 1, st->pktsize);
+    for (j=0; j<ncol; j++) {
+        if (row[j] == 0)
+            continue;
+        if (st->known[j] == 0) {
+            id = j;
+            ce = row[j];
+        } else {
+            value_add(dec_ctx, &v, &st->val[j], row[j], st->pktsize);
+        }
+    }
+    if (unknown == 0) {
+        inac_add_core(dec_ctx, st, &v);
+        return;
+    }
+    value_scale(dec_ctx, &v, galois_divide(1, ce), st->pktsize);
+    st->val[id] = v;
+    inac_known(st, id);
+}
+
+static void inac_propagate(struct bats_decoder_bp *dec_ctx, struct inac_state *st)
+{
+    int k, h;
+    int snum = dec_ctx->param->snum;
+    int ncol = snum + dec_ctx->param->cnum;
+    while (st->qhead < st->qtail) {
+        int id = st->queue[st->qhead++];
+        for (k=0; k<dec_ctx->nbat_of[id]; k++) {
+            int b = dec_ctx->bat_of[id][k];
+            if (st->bused[b] || st->bunk[b] < 0)
+                continue;
+            st->bunk[b] -= 1;
+            inac_batch(dec_ctx, st, b);
+        }
+        if (id >= ncol) {
+            h = id - ncol;
+            if (--st->hunk[h] <= 1)
+                inac_hdpc(dec_ctx, st, h);
+            continue;
+        }
+        for (h=0; h<dec_ctx->param->hnum; h++) {
+            if (dec_ctx->hdpc[(size_t) h*ncol+id] != 0 && --st->hunk[h] <= 1)
+                inac_hdpc(dec_ctx, st, h);
+        }
+        if (dec_ctx->graph == NULL)
+            continue;
+        if (id >= snum) {
+            if (--st->cunk[id-snum] <= 1)
+                inac_check(dec_ctx, st, id-snum);
+        } else {
+            BP_graph *graph = dec_ctx->graph;
+            for (int e=graph->r_of_l_off[id]; e<graph->r_of_l_off[id+1]; e++) {
+                if (--st->cunk[graph->r_of_l_idx[e]] <= 1)
+                    inac_check(dec_ctx, st, graph->r_of_l_idx[e]);
+            }
+        }
+    }
+}
+
+// Choose the packet to inactivate. It's an unknown packet of the batch which lacks the fewest
+// received packets to be solved, or else of the parity-check with the fewest unknown packets,
+// or else of the HDPC equation with the fewest unknown packets. Return -1 if no unknown packet
+// is involved in an unused equation.
+static int inac_choose(struct bats_decoder_bp *dec_ctx, struct inac_state *st)
+{
+    int i, b, c, h;
+    int best = -1;
+    int lack = 0;
+    for (b=0; b<st->nbatch; b++) {
+        if (st->bused[b] || st->bunk[b] <= 0)
+            continue;
+        int l = st->bunk[b] - dec_ctx->batch[b]->nrow;
+        if (best < 0 || l < lack) {
+            best = b;
+            lack = l;
+        }
+    }
+    if (best >= 0) {
+        struct bp_batch *batch = dec_ctx->batch[best];
+        for (i=0; i<batch->degree; i++) {
+            if (st->known[batch->pktid[i]] == 0)
+                return batch->pktid[i];
+        }
+    }
+    for (c=0; c<dec_ctx->param->cnum; c++) {
+        if (st->cused[c] || st->cunk[c] == 0)
+            continue;
+        if (best < 0 || st->cunk[c] < lack) {
+            best = c;
+            lack = st->cunk[c];
+        }
+    }
+    if (best >= 0) {
+        BP_graph *graph = dec_ctx->graph;
+        for (int e=graph->l_of_r_off[best]; e<graph->l_of_r_off[best+1]; e++) {
+            if (st->known[graph->l_of_r_idx[e]] == 0)
+                return graph->l_of_r_idx[e];
+        }
+        return dec_ctx->param->snum + best;
+    }
+    for (h=0; h<dec_ctx->param->hnum; h++) {
+        if (st->hused[h] || st->hunk[h] == 0)
+            continue;
+        if (best < 0 || st->hunk[h] < lack) {
+            best = h;
+            lack = st->hunk[h];
+        }
+    }
+    if (best < 0)
+        return -1;
+    int ncol = dec_ctx->param->snum + dec_ctx->param->cnum;
+    for (i=0; i<ncol; i++) {
+        if (dec_ctx->hdpc[(size_t) best*ncol+i] != 0 && st->known[i] == 0)
+            return i;
+    }
+    return ncol + best;
+}
+
+// Save an equation of the inactivated packets, and take over its memory. When probing, the saved
+// equations are kept in echelon form, so that their number is their rank.
+static void inac_add_core(struct bats_decoder_bp *dec_ctx, struct inac_state *st, struct inac_value *v)
+{
+    int m;
+    if (st->probe) {
+        for (m=0; m<v->len; m++) {
+            if (v->ce[m] == 0)
+                continue;
+            int r = st->pivot[m];
+            if (r < 0)
+                break;
+            struct inac_value *p = &st->core[r];
+            value_extend(v, p->len);
+            GF_ELEMENT quotient = galois_divide(v->ce[m], p->ce[m]);
+            galois_multiply_add_region(&(v->ce[m]), &(p->ce[m]), quotient, p->len-m);
+            dec_ctx->operations += 1 + p->len - m;
+        }
+    } else {
+        for (m=0; m<v->len && v->ce[m]==0; m++)
+            ;
+    }
+    if (m == v->len) {
+        // not innovative
+        free(v->ce);
+        free(v->data);
+        return;
+    }
+    if (st->ncore == st->core_size) {
+        st->core_size = st->core_size == 0 ? 64 : 2*st->core_size;
+        st->core = realloc(st->core, st->core_size*sizeof(struct inac_value));
+    }
+    if (st->probe)
+        st->pivot[m] = st->ncore;
+    st->core[st->ncore++] = *v;
+}
+
+// Solve the inactivated packets by Gaussian elimination, and then the packets expressed in terms
+// of them. Return 1 if the inactivated packets are solvable, 0 otherwise.
+static int inac_solve_core(struct bats_decoder_bp *dec_ctx, struct inac_state *st)
+{
+    static char fname[] = "inac_solve_core";
+    int i, m;
+    int ninact = st->ninact;
+    int ncore = st->ncore;
+    int pktsize = st->pktsize;
+    if (st->unknown != 0 || ncore < ninact)
+        return 0;
+    int solvable = 1;
+    int nalloc = 0;
+    GF_ELEMENT *A[ncore];
+    GF_ELEMENT *B[ncore];
+    for (i=0; i<ncore && solvable; i++) {
+        A[i] = calloc(ninact, sizeof(GF_ELEMENT));
+        B[i] = st->core[i].data != NULL || pktsize == 0 ? st->core[i].data : calloc(pktsize, sizeof(GF_ELEMENT));
+        st->core[i].data = NULL;
+        nalloc += 1;
+        if ((A[i] == NULL && ninact != 0) || (B[i] == NULL && pktsize != 0)) {
+            fprintf(stderr, "%s: calloc core equation %d failed\n", fname, i);
+            solvable = 0;
+            break;
+        }
+        memcpy(A[i], st->core[i].ce, st->core[i].len*sizeof(GF_ELEMENT));
+    }
+    if (solvable && ninact != 0) {
+        dec_ctx->operations += forward_substitute(ncore, ninact, pktsize, A, B);
+        for (m=0; m<ninact; m++) {
+            if (A[m][m] == 0)
+                solvable = 0;
+        }
+    }
+    int numpp = dec_ctx->param->snum + dec_ctx->param->cnum + dec_ctx->param->hnum;
+    // allocate the packets before any is marked decoded, so that a failure leaves all of them undecoded
+    for (i=0; i<numpp && solvable && pktsize != 0; i++) {
+        if (st->known[i] != 2 && st->val[i].data == NULL && (st->val[i].data = calloc(pktsize, sizeof(GF_ELEMENT))) == NULL) {
+            fprintf(stderr, "%s: calloc packet %d failed\n", fname, i);
+            solvable = 0;
+        }
+    }
+    if (solvable) {
+        if (ninact != 0)
+            dec_ctx->operations += back_substitute(ninact, ninact, pktsize, A, B);
+        // substitute the inactivated packets into the other ones
+        for (i=0; i<numpp; i++) {
+            if (st->known[i] == 2)
+                continue;
+            struct inac_value *v = &st->val[i];
+            for (m=0; m<v->len; m++) {
+                galois_multiply_add_region(v->data, B[m], v->ce[m], pktsize);
+                dec_ctx->operations += 1 + pktsize;
+            }
+            dec_ctx->pp[i] = v->data;
+            dec_ctx->known[i] = 1;
+            v->data = NULL;
+            if (i < dec_ctx->param->snum)
+                dec_ctx->decoded += 1;
+        }
+    }
+    for (i=0; i<nalloc; i++) {
+        free(A[i]);
+        free(B[i]);
+    }
+    return solvable;
+}
@@ -1,18 +1,66 @@
 /*
  * A BATS decoder which succeeds as soon as a sufficient number of encoded packets are received. The decoder can determine the innovativeness of coded packets upon reception. To reduce the decoding cost of the straightforward on-the-fly Gaussian elimination, the following decoder pays extra attention to the vector sparseness during  processing each received packet.  
  */
+#define _DEFAULT_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <pthread.h>
 #include "bats.h"
 #include "galois.h"
 
+#define SPARSE_RATIO    16      // rows with more than 1/SPARSE_RATIO nonzeros are stored in full length
+#define ARENA_ALIGN     64      // row stride of arenas is a multiple of cache line size
+#define TILE_CACHE      (256<<10) // bytes of message columns kept in the L2 cache of a core during back-substitution
+#define TILE_MIN        64      // minimum tile width (a cache line), below which region operations are not efficient
+
+// Vector being processed against the decoding matrix
+struct work_vector {
+    int         nz;             // number of nonzeros
+    int         dense;          // whether the elements are in full length or as index/value pairs
+    int         lastnz;         // index of the last nonzero
+    int         buf;            // scratch buffer the index/value pairs are stored in
+    int         *idx;           // sorted indices of nonzeros
+    GF_ELEMENT  *val;           // values of nonzeros
+    GF_ELEMENT  *full;          // full-length elements
+};
+
+// Row operations of back-substitution, which are the same for every column of message symbols
+struct bs_schedule {
+    int         numpp;
+    int         *start;         // operations on row i are start[i], ..., start[i+1]-1
+    int         *src;           // row to be added to row i
+    GF_ELEMENT  *ce;            // coefficient of the added row
+    GF_ELEMENT  *inv;           // inverse of the diagonal element of row i
+    int         tile;           // width of column tiles the schedule is applied to at a time
+    GF_ELEMENT  **message;
+};
+
+// Columns [lo, hi) of message symbols processed by a worker thread
+struct bs_stripe {
+    struct bs_schedule  *sched;
+    int                 lo;
+    int                 hi;
+};
+
 static int process_vector_inbatch(struct bats_decoder_ref *dec_ctx, GF_ELEMENT *vector, GF_ELEMENT *message);
-static int process_vector(struct bats_decoder_ref *dec_ctx, GF_ELEMENT *vector, GF_ELEMENT *message);
+static int process_vector(struct bats_decoder_ref *dec_ctx, struct work_vector *vec, GF_ELEMENT *message, int zeromsg);
+static void apply_pending(struct bats_decoder_ref *dec_ctx, GF_ELEMENT *message, int npend);
+static void load_vector(struct bats_decoder_ref *dec_ctx, struct work_vector *vec, int *ids, GF_ELEMENT *ces, int n);
+static void expand_vector(struct work_vector *vec);
+static void store_row(struct bats_decoder_ref *dec_ctx, struct row_vector *row, struct work_vector *vec, int pivot);
+static void swap_with_row(struct bats_decoder_ref *dec_ctx, struct work_vector *vec, struct row_vector *row, int pivot);
+static void count_coverage(struct bats_decoder_ref *dec_ctx, struct row_vector *row, int pivot, int delta);
 static int apply_parity_check_matrix(struct bats_decoder_ref *dec_ctx);
 static void back_substitution(struct bats_decoder_ref *dec_ctx);
+static void *apply_schedule(void *arg);
+static void check_decoded(struct bats_decoder_ref *dec_ctx, int i);
+static void release_packets(struct bats_decoder_ref *dec_ctx);
 static void bats_free_decoder_currbatch(struct bats_decoder_ref *dec_ctx);
+static void *alloc_arena(size_t size);
+static void free_arena(void *p, size_t size);
 
 extern void init_genrand(unsigned long s);
 
@@ -25,29 +73,38 @@ extern int currbatch;
 struct bats_decoder_ref *bats_create_decoder_ref(BATSparam *param)
 {
     static char fname[] = "bats_create_decoder_ref";
-    struct bats_decoder_ref *dctx = malloc(sizeof(struct bats_decoder_ref));
+    struct bats_decoder_ref *dctx = calloc(1, sizeof(struct bats_decoder_ref));
     dctx->param = param;
     // replicate the precode bipartite graph at the decoder side
     // init mt19937 RNG
     init_genrand(param->seed);
     // create bipartite graph
     if (param->cnum != 0) {
-        if ( (dctx->graph = malloc(sizeof(BP_graph))) == NULL ) {
-            fprintf(stderr, "%s: malloc BP_graph\n", fname);
+        if ( (dctx->graph = acquire_bipartite_graph(param->snum, param->cnum, param->seed)) == NULL ) {
+            fprintf(stderr, "%s: create BP_graph failed\n", fname);
             return NULL;
         }
-        if (create_bipartite_graph(dctx->graph, param->snum, param->cnum) < 0)
-            return NULL;
+    }
+    if (param->hnum != 0) {
+        if ( (dctx->hdpc = create_hdpc_matrix(param->hnum, param->snum+param->cnum, param->seed)) == NULL ) {
+            fprintf(stderr, "%s: create HDPC matrix failed\n", fname);
+            goto AllocError;
+        }
     }
 
     // setup other decoder state information
     dctx->received = 0;
     dctx->overhead = 0;
     dctx->DoF = 0;
-    dctx->seen = calloc(param->snum+param->cnum, sizeof(int));
+    dctx->seen = calloc(param->snum+param->cnum+param->hnum, sizeof(int));
+    dctx->colnz = calloc(param->snum+param->cnum+param->hnum, sizeof(int));
+    if (dctx->seen == NULL || dctx->colnz == NULL) {
+        fprintf(stderr, "%s: calloc dctx->seen/colnz failed\n", fname);
+        goto AllocError;
+    }
     dctx->covered = 0;
     if (param->cnum != 0) {
-        for (int i=0; i<param->snum+param->cnum; i++) {
+        for (int i=0; i<param->snum+param->cnum+param->hnum; i++) {
             dctx->seen[i] = 0;
         }
         // dctx->covered = param->snum+param->cnum;
@@ -57,25 +114,59 @@ struct bats_decoder_ref *bats_create_decoder_ref(BATSparam *param)
     dctx->finished = 0;
     dctx->operations = 0;
 
-    dctx->row = (struct row_vector **) calloc(param->snum+param->cnum, sizeof(struct row_vector *));
+    dctx->row = (struct row_vector **) calloc(param->snum+param->cnum+param->hnum, sizeof(struct row_vector *));
     if (dctx->row == NULL) {
         fprintf(stderr, "%s: calloc dctx->row failed\n", fname);
         goto AllocError;
     }
 
-    dctx->message = calloc(param->snum+param->cnum, sizeof(GF_ELEMENT*));
+    int numpp = param->snum + param->cnum + param->hnum;
+    dctx->rows = calloc(numpp, sizeof(struct row_vector));
+    if (dctx->rows == NULL) {
+        fprintf(stderr, "%s: calloc dctx->rows failed\n", fname);
+        goto AllocError;
+    }
+    // Dense rows are stored at the columns of their elements, so the arena is triangular in
+    // use and the pages below the diagonal are never touched.
+    dctx->coef_stride = ALIGN(numpp, ARENA_ALIGN) * ARENA_ALIGN;
+    dctx->coef = alloc_arena(numpp * dctx->coef_stride);
+    if (dctx->coef == NULL) {
+        fprintf(stderr, "%s: allocate coefficient arena failed\n", fname);
+        goto AllocError;
+    }
+
+    dctx->message = calloc(numpp, sizeof(GF_ELEMENT*));
     if (dctx->message == NULL) {
         fprintf(stderr, "%s: calloc dctx->message failed\n", fname);
         goto AllocError;
     }
-    for (int i=0; i<param->snum+param->cnum; i++) {
-        dctx->message[i] = calloc(param->pktsize, sizeof(GF_ELEMENT));
-        if (dctx->message[i] == NULL) {
-            fprintf(stderr, "%s: calloc dctx->message[%d] failed\n", fname, i);
+    dctx->msg_stride = ALIGN(param->pktsize, ARENA_ALIGN) * ARENA_ALIGN;
+    dctx->msgs = alloc_arena(numpp * dctx->msg_stride);
+    if (dctx->msgs == NULL) {
+        fprintf(stderr, "%s: allocate message arena failed\n", fname);
+        goto AllocError;
+    }
+    for (int i=0; i<numpp; i++)
+        dctx->message[i] = dctx->msgs + i * dctx->msg_stride;
+    dctx->pp = calloc(param->snum+param->cnum+param->hnum, sizeof(GF_ELEMENT*));
+
+    // scratch space of the vector being processed
+    dctx->maxnz = (param->snum+param->cnum+param->hnum) / SPARSE_RATIO;
+    for (int i=0; i<2; i++) {
+        dctx->sp_idx[i] = calloc(2*dctx->maxnz+1, sizeof(int));
+        dctx->sp_val[i] = calloc(2*dctx->maxnz+1, sizeof(GF_ELEMENT));
+        if (dctx->sp_idx[i] == NULL || dctx->sp_val[i] == NULL) {
+            fprintf(stderr, "%s: calloc dctx->sp_idx/sp_val failed\n", fname);
             goto AllocError;
         }
     }
-    dctx->pp = calloc(param->snum+param->cnum, sizeof(GF_ELEMENT*));
+    dctx->full = calloc(param->snum+param->cnum+param->hnum, sizeof(GF_ELEMENT));
+    dctx->pend_row = malloc((param->snum+param->cnum+param->hnum)*sizeof(int));
+    dctx->pend_q = malloc((param->snum+param->cnum+param->hnum)*sizeof(GF_ELEMENT));
+    if (dctx->full == NULL || dctx->pend_row == NULL || dctx->pend_q == NULL) {
+        fprintf(stderr, "%s: calloc dctx->full/pend_row/pend_q failed\n", fname);
+        goto AllocError;
+    }
 
     // small temporaray matrix
     dctx->currbid = -1;
@@ -89,37 +180,76 @@ AllocError:
     return NULL;
 }
 
+// Restore the decoder as just created for another transfer. The precode, arenas and scratch
+// space are kept, and only the rows which have been stored are cleared.
+void bats_reset_decoder_ref(struct bats_decoder_ref *decoder)
+{
+    int numpp = decoder->param->snum + decoder->param->cnum + decoder->param->hnum;
+    for (int i=0; i<numpp; i++) {
+        struct row_vector *row = decoder->row[i];
+        if (row == NULL)
+            continue;
+        if (row->idx != NULL) {
+            free(row->idx);
+            free(row->elem);
+        } else {
+            // dense rows are zero beyond their nonzero span, see store_row()
+            memset(row->elem, 0, row->nzlen*sizeof(GF_ELEMENT));
+        }
+        decoder->row[i] = NULL;
+        decoder->pp[i] = NULL;
+    }
+    memset(decoder->seen, 0, numpp*sizeof(int));
+    memset(decoder->colnz, 0, numpp*sizeof(int));
+    decoder->received = 0;
+    decoder->overhead = 0;
+    decoder->DoF = 0;
+    decoder->covered = 0;
+    decoder->rowcovered = 0;
+    decoder->de_precode = 0;
+    decoder->finished = 0;
+    decoder->operations = 0;
+    decoder->decoded = 0;
+    decoder->released = 0;
+    if (decoder->batch_row != NULL)
+        bats_free_decoder_currbatch(decoder);
+    decoder->currbid = -1;
+    decoder->currpnum = 0;
+}
+
 void bats_free_decoder_ref(struct bats_decoder_ref *decoder)
 {
     // Yes, I know there is memory leak here, but I don't care!
     int i, j;
     int snum = decoder->param->snum;
-    int cnum = decoder->param->cnum;
-    for (i=0; i<snum+cnum; i++) {
-        if (decoder->row[i] != NULL) {
+    int cnum = decoder->param->cnum + decoder->param->hnum;     // LDPC and HDPC packets
+    for (i=0; decoder->row!=NULL && i<snum+cnum; i++) {
+        // only sparse rows are allocated outside of the arenas
+        if (decoder->row[i] != NULL && decoder->row[i]->idx != NULL) {
+            free(decoder->row[i]->idx);
             free(decoder->row[i]->elem);
-            free(decoder->row[i]);
-            decoder->row[i] = NULL;
         }
     }
     free(decoder->row);
-    for (i=0; i<snum+cnum; i++) {
-        if (decoder->message[i] != NULL) {
-            free(decoder->message[i]);
-            decoder->message[i] = NULL;
-        }
-    }
+    free(decoder->rows);
+    free_arena(decoder->coef, (snum+cnum) * decoder->coef_stride);
     free(decoder->message);
-    for (i=0; i<snum+cnum; i++) {
-        if (decoder->pp[i] != NULL) {
-            free(decoder->pp[i]);
-            decoder->pp[i] = NULL;
-        }
+    free_arena(decoder->msgs, (snum+cnum) * decoder->msg_stride);
+    free(decoder->pp);      // recovered packets are rows of the message arena
+    for (i=0; i<2; i++) {
+        free(decoder->sp_idx[i]);
+        free(decoder->sp_val[i]);
     }
-    free(decoder->pp);
+    free(decoder->full);
+    free(decoder->pend_row);
+    free(decoder->pend_q);
+    free(decoder->hdpc);
+    free(decoder->seen);
+    free(decoder->colnz);
     if (decoder->batch_row != NULL) {
         bats_free_decoder_currbatch(decoder);
     }
+    release_bipartite_graph(decoder->graph);
     free(decoder);
     return;
 }
@@ -129,6 +259,7 @@ static void bats_free_decoder_currbatch(struct bats_decoder_ref *dec_ctx)
     int i;
     for (i=0; i<dec_ctx->currpnum; i++) {
         if (dec_ctx->batch_row[i] != NULL) {
+            free(dec_ctx->batch_row[i]->idx);
             free(dec_ctx->batch_row[i]->elem);
             free(dec_ctx->batch_row[i]);
             dec_ctx->batch_row[i] = NULL;
@@ -164,6 +295,14 @@ int bats_process_packet_ref(struct bats_decoder_ref *dec_ctx, BATSpacket *pkt)
         dec_ctx->currpnum = pkt->degree;
         dec_ctx->batch_row = (struct row_vector **) calloc(dec_ctx->currpnum, sizeof(struct row_vector *));
         dec_ctx->batch_msg = calloc(dec_ctx->currpnum, sizeof(GF_ELEMENT*));
+        if (dec_ctx->batch_row == NULL || dec_ctx->batch_msg == NULL) {
+            // packets of this batch go to the global decoding matrix directly
+            fprintf(stderr, "%s: calloc batch_row/batch_msg failed\n", fname);
+            free(dec_ctx->batch_row);
+            free(dec_ctx->batch_msg);
+            dec_ctx->batch_row = NULL;
+            dec_ctx->batch_msg = NULL;
+        }
     }
 
     batchcount += 1;
@@ -178,42 +317,33 @@ int bats_process_packet_ref(struct bats_decoder_ref *dec_ctx, BATSpacket *pkt)
     dec_ctx->received += 1;
     dec_ctx->overhead += 1;
 
-    // Process the received packet in the batch first
-    /*
-    int pivot_ib = process_vector_inbatch(dec_ctx, pkt->coes, pkt->syms);
-
-    if (pivot_ib == -1) {
-        // not an innovative BEV, return
-        return;
-    }
-    */
+    // Process the received packet in the batch first. The packet is reduced in place against
+    // the earlier packets of the batch; if it's not innovative within the batch, it's not
+    // innovative to the global decoding matrix either.
+    int pivot = process_vector_inbatch(dec_ctx, pkt->coes, pkt->syms);
 
     // process the packet against the global decoding matrix
     int i, j, k;
-    GF_ELEMENT quotient;
 
     int pktsize = dec_ctx->param->pktsize;
-    int numpp = dec_ctx->param->snum + dec_ctx->param->cnum;
-
-
-    // Transform BATS packet's encoding vector to full length
-    GF_ELEMENT *ces = calloc(numpp, sizeof(GF_ELEMENT));
-    if (ces == NULL)
-        fprintf(stderr, "%s: calloc ces failed\n", fname);
-    for (i=0; i<pkt->degree; i++)
-        ces[pkt->pktid[i]] = pkt->coes[i];
+    int numpp = dec_ctx->param->snum + dec_ctx->param->cnum + dec_ctx->param->hnum;
 
-    // Process full-length encoding vector against decoding matrix
     int lastDoF = dec_ctx->DoF;
-    int pivot = process_vector(dec_ctx, ces, pkt->syms);
+    if (pivot >= 0) {
+        // Load BATS packet's encoding vector as index/value pairs, which is expanded to
+        // full length only if it's dense
+        struct work_vector vec;
+        load_vector(dec_ctx, &vec, pkt->pktid, pkt->coes, pkt->degree);
+
+        // Process the encoding vector against decoding matrix
+        pivot = process_vector(dec_ctx, &vec, pkt->syms, 0);
+    }
 
     int newDoF = pivot >=0 ? 1 : 0;
     printf("[Batch %d] Received-DoF: %d New-DoF: %d\n", currbatch, curr_DoF, newDoF);
 
-    free(ces);
-    ces = NULL;
     // Apply parity-check vectors
-    if (dec_ctx->DoF == dec_ctx->param->snum && dec_ctx->param->cnum != 0) {
+    if (dec_ctx->DoF == dec_ctx->param->snum && dec_ctx->param->cnum + dec_ctx->param->hnum != 0) {
         dec_ctx->de_precode = 1;    /*Mark de_precode before applying precode matrix*/
         
         applying_precode = 1;
@@ -221,50 +351,26 @@ int bats_process_packet_ref(struct bats_decoder_ref *dec_ctx, BATSpacket *pkt)
         applying_precode = 0;
         printf("After applying the parity-check matrix, %d DoF are missing.\n", missing_DoF);
         dec_ctx->DoF = numpp - missing_DoF;
-        // double check how many packets are not seen yet after applying precode
-        int total_covered = 0;
-        for (int i=0; i<numpp; i++) {
-            if (dec_ctx->row[i] != NULL) {
-                total_covered += 1;
-                dec_ctx->seen[i] = 1;       // mark seen list as well
-                continue;                   // covered for sure
-            }
-            else {
-                // need to check if above rows have the packet covered. Example:
-                // 1 x x 0
-                // 0 0 x 0
-                // 0 0 x 0
-                // 0 0 0 0
-                // The second packet IS covered and the last one IS NOT.
-                int covered = 0;
-                for (int j=0; j<i; j++) {
-                    if (dec_ctx->row[j] == NULL || dec_ctx->row[j]->len < i-j+1)
-                        continue;
-                    else {
-                        if (dec_ctx->row[j]->elem[i-j] != 0) {
-                            covered = 1;
-                            dec_ctx->seen[i] = 1;
-                            break;          // packet i is covered in the j-th row
-                        }
-                    }
-                }
-                if (covered)
-                    total_covered += 1;
-            }
-        }
-        dec_ctx->covered = total_covered;
-        printf("After applying precode, %d packets are covered\n", total_covered);
+        // A packet is covered if its column has nonzero in some row of the decoding matrix,
+        // which is counted as rows are stored and swapped. The seen list is marked accordingly.
+        dec_ctx->covered = dec_ctx->rowcovered;
+        printf("After applying precode, %d packets are covered\n", dec_ctx->covered);
     }
 
-    if (dec_ctx->DoF == dec_ctx->param->snum + dec_ctx->param->cnum) {
+    if (dec_ctx->DoF == numpp) {
         back_substitution(dec_ctx);
         printf("Received %d packets from batch %d and %d are innovative\n", batchcount, currbatch, dofcount);
     }
+    release_packets(dec_ctx);
 }
 
+// Process a BATS packet against the echelon matrix of the earlier packets of its batch, which
+// is only degree-sized. The coding vector and message are reduced in place, and the packet is
+// saved as a new row if it's innovative within the batch. Row operations on the message are
+// deferred until the packet turns out innovative.
 static int process_vector_inbatch(struct bats_decoder_ref *dec_ctx, GF_ELEMENT *vector, GF_ELEMENT *message)
 {
-    static char fname[] = "process_vector";
+    static char fname[] = "process_vector_inbatch";
     int i, j, k;
     int pivot = -1;
     int pivotfound = 0;
@@ -272,17 +378,21 @@ static int process_vector_inbatch(struct bats_decoder_ref *dec_ctx, GF_ELEMENT *
 
     int pktsize = dec_ctx->param->pktsize;
     int numpp   = dec_ctx->currpnum;
+    int npend   = 0;
+
+    if (dec_ctx->batch_row == NULL)
+        return 0;
 
-    int rowop = 0;
     for (i=0; i<numpp; i++) {
         if (vector[i] != 0) {
-            if (dec_ctx->batch_row[i] != NULL) {
+            struct row_vector *row = dec_ctx->batch_row[i];
+            if (row != NULL) {
                 /* There is a valid row saved for pivot-i, process against it */
-                quotient = galois_divide(vector[i], dec_ctx->batch_row[i]->elem[0]);
-                galois_multiply_add_region(&(vector[i]), dec_ctx->batch_row[i]->elem, quotient, dec_ctx->batch_row[i]->len);
-                galois_multiply_add_region(message, dec_ctx->batch_msg[i], quotient, pktsize);
-                dec_ctx->operations += 1 + dec_ctx->batch_row[i]->len + pktsize;
-                rowop += 1;
+                quotient = galois_divide(vector[i], row->elem[0]);
+                galois_multiply_add_region(&(vector[i]), row->elem, quotient, row->nzlen);
+                dec_ctx->pend_row[npend] = i;
+                dec_ctx->pend_q[npend++] = quotient;
+                dec_ctx->operations += 1 + row->nzlen;
             } else {
                 pivotfound = 1;
                 pivot = i;
@@ -291,122 +401,333 @@ static int process_vector_inbatch(struct bats_decoder_ref *dec_ctx, GF_ELEMENT *
         }
     }
 
-    if (pivotfound == 1) {
-        /* Save it to the corresponding row */
-        dec_ctx->batch_row[pivot] = (struct row_vector*) malloc(sizeof(struct row_vector));
-        if (dec_ctx->batch_row[pivot] == NULL)
-            fprintf(stderr, "%s: malloc dec_ctx->row[%d] failed\n", fname, pivot);
-        int len = numpp - pivot;
-        dec_ctx->batch_row[pivot]->len = len;
+    if (pivotfound == 0)
+        return -1;
 
-        dec_ctx->batch_row[pivot]->elem = (GF_ELEMENT *) calloc(len, sizeof(GF_ELEMENT));
-        if (dec_ctx->batch_row[pivot]->elem == NULL)
-            fprintf(stderr, "%s: calloc dec_ctx->row[%d]->elem failed\n", fname, pivot);
-        memcpy(dec_ctx->batch_row[pivot]->elem, &(vector[pivot]), len*sizeof(GF_ELEMENT));
+    for (k=0; k<npend; k++) {
+        galois_multiply_add_region(message, dec_ctx->batch_msg[dec_ctx->pend_row[k]], dec_ctx->pend_q[k], pktsize);
+        dec_ctx->operations += pktsize;
+    }
 
-        dec_ctx->batch_msg[pivot] = (GF_ELEMENT *) calloc(pktsize, sizeof(GF_ELEMENT));
-        memcpy(dec_ctx->batch_msg[pivot], message,  pktsize*sizeof(GF_ELEMENT));
+    /* Save it to the corresponding row */
+    int len = numpp - pivot;
+    struct row_vector *row = malloc(sizeof(struct row_vector));
+    GF_ELEMENT *elem = malloc(len * sizeof(GF_ELEMENT));
+    GF_ELEMENT *msg  = malloc(pktsize * sizeof(GF_ELEMENT));
+    if (row == NULL || elem == NULL || (msg == NULL && pktsize != 0)) {
+        // the packet is still forwarded, later packets of the batch are just not reduced against it
+        fprintf(stderr, "%s: malloc batch row %d failed\n", fname, pivot);
+        free(row);
+        free(elem);
+        free(msg);
+        return pivot;
     }
+    memcpy(elem, &(vector[pivot]), len*sizeof(GF_ELEMENT));
+    row->len  = len;
+    row->elem = elem;
+    row->idx  = NULL;
+    row->nz   = galois_count_nonzeros(elem, len);
+    row->nzlen = galois_last_nonzero(elem, len) + 1;
+    memcpy(msg, message, pktsize*sizeof(GF_ELEMENT));
+    dec_ctx->batch_row[pivot] = row;
+    dec_ctx->batch_msg[pivot] = msg;
     return pivot;
 }
 
-static int process_vector(struct bats_decoder_ref *dec_ctx, GF_ELEMENT *vector, GF_ELEMENT *message)
+// Process a vector against the decoding matrix, and save it as a new row if it's innovative.
+// If zeromsg is set, the message is taken as zero regardless of its content, and the row
+// operations on it are only applied when the message is needed.
+static int process_vector(struct bats_decoder_ref *dec_ctx, struct work_vector *vec, GF_ELEMENT *message, int zeromsg)
 {
-    static char fname[] = "process_vector";
     int i, j, k;
     int pivot = -1;
     int pivotfound = 0;
     GF_ELEMENT quotient;
 
     int pktsize = dec_ctx->param->pktsize;
-    int numpp   = dec_ctx->param->snum + dec_ctx->param->cnum;
+    int numpp   = dec_ctx->param->snum + dec_ctx->param->cnum + dec_ctx->param->hnum;
+    int npend   = zeromsg ? 0 : -1;     // number of pending row operations, -1 if the message is up to date
 
     int rowop = 0;
-    for (i=0; i<numpp; i++) {
-        if (vector[i] != 0) {
-            // calculate the density of the vector
-            int density_c = 0;
-            for (j=i; j<numpp; j++) {
-                if (vector[j] != 0)
-                    density_c += 1;
+    i = -1;
+    while (vec->nz > 0) {
+        // locate the leading nonzero; elements before the last processed one are all zero
+        if (vec->dense) {
+            i = i + 1 + galois_first_nonzero(&(vec->full[i+1]), vec->lastnz-i);
+        } else {
+            i = vec->idx[0];
+        }
+        struct row_vector *row = dec_ctx->row[i];
+        if (row == NULL) {
+            pivotfound = 1;
+            pivot = i;
+            break;
+        }
+        // There is a valid row saved for pivot-i, process against it
+        // But swap if the vector is sparser than the stored one before processing.
+        if (vec->nz < row->nz) {
+            count_coverage(dec_ctx, row, i, -1);
+            swap_with_row(dec_ctx, vec, row, i);
+            count_coverage(dec_ctx, row, i, 1);
+            if (npend >= 0) {
+                apply_pending(dec_ctx, message, npend);
+                npend = -1;
             }
-
-            // calculate the length between the leading element and the last nonzero
-            int nzlen_c = 0;  
-            for (j=numpp-1; j>=0; j--) {
-                if (vector[j] != 0) {
-                    nzlen_c = j - i + 1;
-                    break;
-                }
+            for (j=0; j<pktsize; j++) {
+                GF_ELEMENT temp = dec_ctx->message[i][j];
+                dec_ctx->message[i][j] = message[j];
+                message[j] = temp;
             }
+            check_decoded(dec_ctx, i);
+        }
 
-            if (dec_ctx->row[i] != NULL) {
-                // There is a valid row saved for pivot-i, process against it
-                // But swap if the vector is sparser than the stored one before processing.
-                int density = 0;
-                for (j=0; j<dec_ctx->row[i]->len; j++) {
-                    if (dec_ctx->row[i]->elem[j] != 0)
-                        density += 1;
-                }
-
-                int nzlen = 0;
-                for (j=dec_ctx->row[i]->len-1; j>=0; j--) {
-                    if (dec_ctx->row[i]->elem[j] != 0) {
-                        nzlen = j - i + 1;
-                        break;
+        quotient = galois_divide(vec->dense ? vec->full[i] : vec->val[0], row->elem[0]);
+        if (row->idx != NULL && !vec->dense) {
+            // both are sparse, merge their index/value pairs
+            int *oidx = dec_ctx->sp_idx[1-vec->buf];
+            GF_ELEMENT *oval = dec_ctx->sp_val[1-vec->buf];
+            int a = 0, b = 0, n = 0;
+            while (a < vec->nz || b < row->nz) {
+                int ca = a < vec->nz ? vec->idx[a] : numpp;
+                int cb = b < row->nz ? i + row->idx[b] : numpp;
+                if (ca < cb) {
+                    oidx[n] = ca;
+                    oval[n++] = vec->val[a++];
+                } else if (cb < ca) {
+                    oidx[n] = cb;
+                    oval[n++] = galois_multiply(row->elem[b++], quotient);
+                } else {
+                    GF_ELEMENT e = galois_add(vec->val[a++], galois_multiply(row->elem[b++], quotient));
+                    if (e != 0) {
+                        oidx[n] = ca;
+                        oval[n++] = e;
                     }
                 }
-
-                // perform swap
-                if (density_c < density) {
-                    for (j=0; j<dec_ctx->row[i]->len; j++) {
-                        GF_ELEMENT temp = dec_ctx->row[i]->elem[j];
-                        dec_ctx->row[i]->elem[j] = vector[i+j];
-                        vector[i+j] = temp;
-                    }
-                    //GF_ELEMENT *temp = dec_ctx->message[i];
-                    //dec_ctx->message[i] = message;
-                    // message = temp;
-                    for (j=0; j<pktsize; j++) {
-                        GF_ELEMENT temp = dec_ctx->message[i][j];
-                        dec_ctx->message[i][j] = message[j];
-                        message[j] = temp;
-                    }
+            }
+            vec->buf = 1 - vec->buf;
+            vec->idx = oidx;
+            vec->val = oval;
+            vec->nz  = n;
+            vec->lastnz = n > 0 ? oidx[n-1] : -1;
+            if (vec->nz > dec_ctx->maxnz)
+                expand_vector(vec);
+            dec_ctx->operations += 1 + row->nz;
+        } else {
+            if (!vec->dense)
+                expand_vector(vec);
+            // the vector changes only within the nonzero span of the stored row
+            int nzlen = row->nzlen;
+            if (row->idx != NULL) {
+                for (k=0; k<row->nz; k++) {
+                    GF_ELEMENT *e = &(vec->full[i+row->idx[k]]);
+                    int wasnz = (*e != 0);
+                    *e = galois_add(*e, galois_multiply(row->elem[k], quotient));
+                    vec->nz += (*e != 0) - wasnz;
                 }
-
-                quotient = galois_divide(vector[i], dec_ctx->row[i]->elem[0]);
-                galois_multiply_add_region(&(vector[i]), dec_ctx->row[i]->elem, quotient, dec_ctx->row[i]->len);
-                galois_multiply_add_region(message, dec_ctx->message[i], quotient, pktsize);
-                dec_ctx->operations += 1 + dec_ctx->row[i]->len + pktsize;
-                rowop += 1;
+                dec_ctx->operations += 1 + row->nz;
             } else {
-                pivotfound = 1;
-                pivot = i;
-                break;
+                int density_s = galois_count_nonzeros(&(vec->full[i]), nzlen);
+                galois_multiply_add_region(&(vec->full[i]), row->elem, quotient, nzlen);
+                vec->nz += galois_count_nonzeros(&(vec->full[i]), nzlen) - density_s;
+                dec_ctx->operations += 1 + nzlen;
             }
+            // the last nonzero might have been cancelled
+            j = vec->lastnz > i + nzlen - 1 ? vec->lastnz : i + nzlen - 1;
+            j = i + 1 + galois_last_nonzero(&(vec->full[i+1]), j-i);
+            vec->lastnz = j > i ? j : -1;
         }
+        if (npend >= 0) {
+            // rows before the current position are not swapped any more, nor are their messages
+            dec_ctx->pend_row[npend] = i;
+            dec_ctx->pend_q[npend++] = quotient;
+        } else {
+            galois_multiply_add_region(message, dec_ctx->message[i], quotient, pktsize);
+            dec_ctx->operations += pktsize;
+        }
+        rowop += 1;
     }
 
     if (pivotfound == 1) {
         /* Save it to the corresponding row */
-        dec_ctx->row[pivot] = (struct row_vector*) malloc(sizeof(struct row_vector));
-        if (dec_ctx->row[pivot] == NULL)
-            fprintf(stderr, "%s: malloc dec_ctx->row[%d] failed\n", fname, pivot);
-        int len = numpp - pivot;
-        dec_ctx->row[pivot]->len = len;
-        dec_ctx->row[pivot]->elem = (GF_ELEMENT *) calloc(len, sizeof(GF_ELEMENT));
-        if (dec_ctx->row[pivot]->elem == NULL)
-            fprintf(stderr, "%s: calloc dec_ctx->row[%d]->elem failed\n", fname, pivot);
-        memcpy(dec_ctx->row[pivot]->elem, &(vector[pivot]), len*sizeof(GF_ELEMENT));
+        if (npend >= 0)
+            apply_pending(dec_ctx, message, npend);
+        dec_ctx->row[pivot] = &(dec_ctx->rows[pivot]);
+        store_row(dec_ctx, dec_ctx->row[pivot], vec, pivot);
+        count_coverage(dec_ctx, dec_ctx->row[pivot], pivot, 1);
         memcpy(dec_ctx->message[pivot], message,  pktsize*sizeof(GF_ELEMENT));
+        check_decoded(dec_ctx, pivot);
         //printf("received-DoF %d new-DoF %d row_ops: %d\n", dec_ctx->DoF, pivot, rowop);
         dec_ctx->DoF += 1;
         if (!applying_precode)
             dofcount += 1;    // don't count dofs provided by the parity-check packets
+        // leave the full-length scratch space zeroed for the next vector
+        if (vec->dense)
+            memset(&(vec->full[pivot]), 0, (vec->lastnz-pivot+1)*sizeof(GF_ELEMENT));
     }
     return pivot;
 }
 
+// Apply the pending row operations to a zero message
+static void apply_pending(struct bats_decoder_ref *dec_ctx, GF_ELEMENT *message, int npend)
+{
+    int pktsize = dec_ctx->param->pktsize;
+    memset(message, 0, pktsize*sizeof(GF_ELEMENT));
+    for (int k=0; k<npend; k++) {
+        galois_multiply_add_region(message, dec_ctx->message[dec_ctx->pend_row[k]], dec_ctx->pend_q[k], pktsize);
+        dec_ctx->operations += pktsize;
+    }
+}
+
+// Load a vector given by packet ids and coefficients. The vector is expanded to full
+// length straight away if it has more than maxnz elements.
+static void load_vector(struct bats_decoder_ref *dec_ctx, struct work_vector *vec, int *ids, GF_ELEMENT *ces, int n)
+{
+    int i, j;
+    vec->buf  = 0;
+    vec->idx  = dec_ctx->sp_idx[0];
+    vec->val  = dec_ctx->sp_val[0];
+    vec->full = dec_ctx->full;
+    vec->nz   = 0;
+    vec->lastnz = -1;
+    if (n > dec_ctx->maxnz) {
+        vec->dense = 1;
+        for (i=0; i<n; i++) {
+            if (ces[i] == 0)
+                continue;
+            vec->full[ids[i]] = ces[i];
+            vec->nz += 1;
+            if (ids[i] > vec->lastnz)
+                vec->lastnz = ids[i];
+        }
+        return;
+    }
+    vec->dense = 0;
+    for (i=0; i<n; i++) {
+        if (ces[i] == 0)
+            continue;
+        // insertion sort, which is linear for ids in the ascending order as encoder generates
+        for (j=vec->nz; j>0 && vec->idx[j-1]>ids[i]; j--) {
+            vec->idx[j] = vec->idx[j-1];
+            vec->val[j] = vec->val[j-1];
+        }
+        vec->idx[j] = ids[i];
+        vec->val[j] = ces[i];
+        vec->nz += 1;
+    }
+    vec->lastnz = vec->nz > 0 ? vec->idx[vec->nz-1] : -1;
+}
+
+// Switch a vector from index/value pairs to full length
+static void expand_vector(struct work_vector *vec)
+{
+    for (int i=0; i<vec->nz; i++)
+        vec->full[vec->idx[i]] = vec->val[i];
+    vec->dense = 1;
+}
+
+// Save a vector whose leading nonzero is at pivot to a row. The row is stored as
+// index/value pairs if it has at most maxnz nonzeros.
+static void store_row(struct bats_decoder_ref *dec_ctx, struct row_vector *row, struct work_vector *vec, int pivot)
+{
+    static char fname[] = "store_row";
+    int i, k;
+    int numpp = dec_ctx->param->snum + dec_ctx->param->cnum + dec_ctx->param->hnum;
+    row->len   = numpp - pivot;
+    row->nz    = vec->nz;
+    row->nzlen = vec->lastnz - pivot + 1;
+    if (vec->nz <= dec_ctx->maxnz) {
+        row->idx  = malloc(vec->nz * sizeof(int));
+        row->elem = malloc(vec->nz * sizeof(GF_ELEMENT));
+        if (row->idx == NULL || row->elem == NULL)
+            fprintf(stderr, "%s: malloc row->idx/elem failed\n", fname);
+        if (vec->dense) {
+            for (i=pivot, k=0; i<=vec->lastnz; i++) {
+                i += galois_first_nonzero(&(vec->full[i]), vec->lastnz-i+1);
+                if (i > vec->lastnz)
+                    break;
+                row->idx[k] = i - pivot;
+                row->elem[k++] = vec->full[i];
+            }
+        } else {
+            for (k=0; k<vec->nz; k++) {
+                row->idx[k] = vec->idx[k] - pivot;
+                row->elem[k] = vec->val[k];
+            }
+        }
+    } else {
+        // the arena slot is all-zero as long as the row is not dense
+        row->idx  = NULL;
+        row->elem = dec_ctx->coef + pivot * dec_ctx->coef_stride + pivot;
+        if (vec->dense) {
+            memcpy(row->elem, &(vec->full[pivot]), row->nzlen*sizeof(GF_ELEMENT));
+        } else {
+            for (k=0; k<vec->nz; k++)
+                row->elem[vec->idx[k]-pivot] = vec->val[k];
+        }
+    }
+}
+
+// Exchange the vector with the stored row of the same pivot
+static void swap_with_row(struct bats_decoder_ref *dec_ctx, struct work_vector *vec, struct row_vector *row, int pivot)
+{
+    int k;
+    struct row_vector old = *row;
+    if (old.idx == NULL && vec->dense && vec->nz > dec_ctx->maxnz) {
+        // both are dense, exchange the elements in the arena slot
+        int n = old.nzlen > vec->lastnz-pivot+1 ? old.nzlen : vec->lastnz-pivot+1;
+        for (k=0; k<n; k++) {
+            GF_ELEMENT tmp = row->elem[k];
+            row->elem[k] = vec->full[pivot+k];
+            vec->full[pivot+k] = tmp;
+        }
+        row->nz = vec->nz;
+        row->nzlen = vec->lastnz - pivot + 1;
+        vec->nz = old.nz;
+        vec->lastnz = pivot + old.nzlen - 1;
+        return;
+    }
+    store_row(dec_ctx, row, vec, pivot);
+    if (vec->dense)
+        memset(&(vec->full[pivot]), 0, (vec->lastnz-pivot+1)*sizeof(GF_ELEMENT));
+    if (old.idx != NULL && !vec->dense) {
+        for (k=0; k<old.nz; k++) {
+            vec->idx[k] = pivot + old.idx[k];
+            vec->val[k] = old.elem[k];
+        }
+    } else {
+        vec->dense = 1;
+        if (old.idx != NULL) {
+            for (k=0; k<old.nz; k++)
+                vec->full[pivot+old.idx[k]] = old.elem[k];
+        } else {
+            memcpy(&(vec->full[pivot]), old.elem, old.nzlen*sizeof(GF_ELEMENT));
+            memset(old.elem, 0, old.nzlen*sizeof(GF_ELEMENT));
+        }
+    }
+    vec->nz = old.nz;
+    vec->lastnz = pivot + old.nzlen - 1;
+    if (old.idx != NULL) {
+        free(old.idx);
+        free(old.elem);
+    }
+}
+
+// Count the nonzeros of a row being stored (delta=1) or removed (delta=-1) at their columns
+static void count_coverage(struct bats_decoder_ref *dec_ctx, struct row_vector *row, int pivot, int delta)
+{
+    int n = row->idx != NULL ? row->nz : row->nzlen;
+    for (int k=0; k<n; k++) {
+        if (row->elem[k] == 0)
+            continue;
+        int c = pivot + (row->idx != NULL ? row->idx[k] : k);
+        if (delta > 0 && dec_ctx->colnz[c]++ == 0) {
+            dec_ctx->rowcovered += 1;
+            dec_ctx->seen[c] = 1;
+        } else if (delta < 0 && --dec_ctx->colnz[c] == 0) {
+            dec_ctx->rowcovered -= 1;
+        }
+    }
+}
 
 // Apply the parity-check matrix to the decoding matrix
 static int apply_parity_check_matrix(struct bats_decoder_ref *dec_ctx)
@@ -416,24 +737,43 @@ static int apply_parity_check_matrix(struct bats_decoder_ref *dec_ctx)
     int num_of_new_DoF = 0;
 
     int pktsize = dec_ctx->param->pktsize;
-    int numpp = dec_ctx->param->snum + dec_ctx->param->cnum;
+    int numpp = dec_ctx->param->snum + dec_ctx->param->cnum + dec_ctx->param->hnum;
 
     // 1, Copy parity-check vectors to the nonzero rows of the decoding matrix
+    int *ids = malloc(numpp*sizeof(int));
     GF_ELEMENT *ces = malloc(numpp*sizeof(GF_ELEMENT));
     GF_ELEMENT *msg = malloc(pktsize*sizeof(GF_ELEMENT));
+    struct work_vector vec;
     int p = 0;          // index pointer to the parity-check vector that is to be copyed
     for (int p=0; p<dec_ctx->param->cnum; p++) {
-        memset(ces, 0, numpp*sizeof(GF_ELEMENT));
-        memset(msg, 0, pktsize*sizeof(GF_ELEMENT));
         /* Set the coding vector according to parity-check bits */
-        NBR_node *varnode = dec_ctx->graph->l_nbrs_of_r[p]->first;
-        while (varnode != NULL) {
-            ces[varnode->data] = varnode->ce;
-            varnode = varnode->next;
+        int n = 0;
+        BP_graph *graph = dec_ctx->graph;
+        for (int e=graph->l_of_r_off[p]; e<graph->l_of_r_off[p+1]; e++) {
+            ids[n] = graph->l_of_r_idx[e];
+            ces[n++] = graph->l_of_r_ce[e];
         }
-        ces[dec_ctx->param->snum+p] = 1;
-        int pivot = process_vector(dec_ctx, ces, msg);
+        ids[n] = dec_ctx->param->snum+p;
+        ces[n++] = 1;
+        load_vector(dec_ctx, &vec, ids, ces, n);
+        process_vector(dec_ctx, &vec, msg, 1);
     }
+    // HDPC vectors are dense over the source and LDPC packets
+    int ncol = dec_ctx->param->snum + dec_ctx->param->cnum;
+    for (int h=0; h<dec_ctx->param->hnum; h++) {
+        int n = 0;
+        for (j=0; j<ncol; j++) {
+            if (dec_ctx->hdpc[(size_t) h*ncol+j] != 0) {
+                ids[n] = j;
+                ces[n++] = dec_ctx->hdpc[(size_t) h*ncol+j];
+            }
+        }
+        ids[n] = ncol + h;
+        ces[n++] = 1;
+        load_vector(dec_ctx, &vec, ids, ces, n);
+        process_vector(dec_ctx, &vec, msg, 1);
+    }
+    free(ids);
     free(ces);
     free(msg);
 
@@ -450,33 +790,224 @@ static int apply_parity_check_matrix(struct bats_decoder_ref *dec_ctx)
 }
 
 
+// Back-substitution is done in two steps. The row operations are first derived from the
+// coefficient rows, which are the same for every column of the message symbols. Then they are
+// applied to the message rows, which are split into column stripes among worker threads if
+// BATS_THREADS is set.
 static void back_substitution(struct bats_decoder_ref *dec_ctx)
 {
+    static char fname[] = "back_substitution";
     int pktsize = dec_ctx->param->pktsize;
-    int numpp = dec_ctx->param->snum + dec_ctx->param->cnum;
-    int i, j;
-    int len;
-    GF_ELEMENT quotient;
-    for (i=numpp-1; i>=0; i--) {
-        /* eliminate all nonzeros above diagonal elements from right to left*/
-        for (j=0; j<i; j++) {
-            len = dec_ctx->row[j]->len;
-            if (j+len <= i || dec_ctx->row[j]->elem[i-j] == 0)
+    int numpp = dec_ctx->param->snum + dec_ctx->param->cnum + dec_ctx->param->hnum;
+    int i, k, n;
+
+    if (pktsize == 0) {
+        // rank-only mode, full rank is all that matters
+        for (i=0; i<numpp; i++)
+            dec_ctx->pp[i] = dec_ctx->message[i];
+        dec_ctx->decoded = dec_ctx->param->snum;
+        dec_ctx->finished = 1;
+        return;
+    }
+
+    struct bs_schedule sched;
+    sched.numpp   = numpp;
+    sched.message = dec_ctx->message;
+    sched.start   = malloc((numpp+1)*sizeof(int));
+    sched.inv     = malloc(numpp*sizeof(GF_ELEMENT));
+    int nops = 0;
+    for (i=0; i<numpp; i++)
+        nops += dec_ctx->row[i]->nz - 1;
+    sched.src = malloc(nops*sizeof(int) + 1);
+    sched.ce  = malloc(nops*sizeof(GF_ELEMENT) + 1);
+    if (sched.start == NULL || sched.inv == NULL || sched.src == NULL || sched.ce == NULL) {
+        fprintf(stderr, "%s: malloc schedule failed\n", fname);
+        goto Release;
+    }
+    for (i=0, n=0; i<numpp; i++) {
+        struct row_vector *row = dec_ctx->row[i];
+        sched.start[i] = n;
+        /* eliminate nonzeros on the right of diagonal element using the decoded packets */
+        int nz = row->idx != NULL ? row->nz : row->nzlen;
+        for (k=1; k<nz; k++) {
+            if (row->elem[k] == 0)
                 continue;
-            quotient = galois_divide(dec_ctx->row[j]->elem[i-j], dec_ctx->row[i]->elem[0]);
-            galois_multiply_add_region(dec_ctx->message[j], dec_ctx->message[i], quotient, pktsize);
+            sched.src[n] = i + (row->idx != NULL ? row->idx[k] : k);
+            sched.ce[n++] = row->elem[k];
             dec_ctx->operations += (pktsize + 1);
-            dec_ctx->row[j]->elem[i-j] = 0;
+            row->elem[k] = 0;
+            dec_ctx->colnz[sched.src[n-1]] -= 1;
         }
         /* convert diagonal to 1*/
-        if (dec_ctx->row[i]->elem[0] != 1) {
-            galois_multiply_region(dec_ctx->message[i], galois_divide(1, dec_ctx->row[i]->elem[0]), pktsize);
+        sched.inv[i] = galois_divide(1, row->elem[0]);
+        if (row->elem[0] != 1) {
             dec_ctx->operations += (pktsize + 1);
-            dec_ctx->row[i]->elem[0] = 1;
+            row->elem[0] = 1;
         }
-        /* save decoded packet */
-        dec_ctx->pp[i] = calloc(pktsize, sizeof(GF_ELEMENT));
-        memcpy(dec_ctx->pp[i], dec_ctx->message[i], pktsize*sizeof(GF_ELEMENT));
+        row->nz = 1;
+        row->nzlen = 1;
     }
+    sched.start[numpp] = n;
+    // all rows of a column tile should stay in cache while the schedule runs through
+    sched.tile = TILE_CACHE / numpp / ARENA_ALIGN * ARENA_ALIGN;
+    if (sched.tile < TILE_MIN)
+        sched.tile = TILE_MIN;
+
+    // Split the message columns into stripes of whole cache lines
+    char *nt = getenv("BATS_THREADS");
+    int nthread = nt != NULL ? atoi(nt) : 1;
+    if (nthread > ALIGN(pktsize, ARENA_ALIGN))
+        nthread = ALIGN(pktsize, ARENA_ALIGN);
+    if (nthread <= 1) {
+        struct bs_stripe stripe = {&sched, 0, pktsize};
+        apply_schedule(&stripe);
+    } else {
+        pthread_t tid[nthread];
+        int started[nthread];
+        struct bs_stripe stripe[nthread];
+        int width = ALIGN(ALIGN(pktsize, ARENA_ALIGN), nthread) * ARENA_ALIGN;
+        for (i=0; i<nthread; i++) {
+            stripe[i].sched = &sched;
+            stripe[i].lo = i * width < pktsize ? i * width : pktsize;
+            stripe[i].hi = (i+1) * width < pktsize ? (i+1) * width : pktsize;
+            started[i] = pthread_create(&tid[i], NULL, apply_schedule, &stripe[i]) == 0;
+            if (!started[i]) {
+                fprintf(stderr, "%s: pthread_create failed, applying stripe %d in place\n", fname, i);
+                apply_schedule(&stripe[i]);
+            }
+        }
+        for (i=0; i<nthread; i++) {
+            if (started[i])
+                pthread_join(tid[i], NULL);
+        }
+    }
+    /* packets are decoded in place */
+    for (i=0; i<numpp; i++)
+        dec_ctx->pp[i] = dec_ctx->message[i];
+    dec_ctx->decoded = dec_ctx->param->snum;
     dec_ctx->finished = 1;
+
+Release:
+    free(sched.start);
+    free(sched.inv);
+    free(sched.src);
+    free(sched.ce);
+}
+
+// Apply the back-substitution schedule to columns [lo, hi) of the message rows. The columns
+// are processed tile by tile, so that the rows added to a row are still in cache.
+static void *apply_schedule(void *arg)
+{
+    struct bs_stripe *stripe = arg;
+    struct bs_schedule *sched = stripe->sched;
+    for (int lo=stripe->lo; lo<stripe->hi; lo+=sched->tile) {
+        int len = stripe->hi - lo < sched->tile ? stripe->hi - lo : sched->tile;
+        for (int i=sched->numpp-1; i>=0; i--) {
+            GF_ELEMENT *msg = sched->message[i] + lo;
+            for (int k=sched->start[i]; k<sched->start[i+1]; k++)
+                galois_multiply_add_region(msg, sched->message[sched->src[k]] + lo, sched->ce[k], len);
+            if (sched->inv[i] != 1)
+                galois_multiply_region(msg, sched->inv[i], len);
+        }
+    }
+    return NULL;
+}
+
+void bats_set_delivery_ref(struct bats_decoder_ref *dec_ctx, void (*deliver)(void *arg, int id, GF_ELEMENT *pkt), void *arg)
+{
+    dec_ctx->deliver = deliver;
+    dec_ctx->deliver_arg = arg;
+}
+
+// Common decoder interface
+static int ref_process(void *dec, BATSpacket *pkt)
+{
+    return bats_process_packet_ref(dec, pkt);
+}
+
+static int ref_finished(void *dec)
+{
+    return ((struct bats_decoder_ref *) dec)->finished;
+}
+
+static int ref_DoF(void *dec)
+{
+    return ((struct bats_decoder_ref *) dec)->DoF;
+}
+
+static void ref_reset(void *dec)
+{
+    bats_reset_decoder_ref(dec);
+}
+
+static void ref_free(void *dec)
+{
+    bats_free_decoder_ref(dec);
+}
+
+static int ref_overhead(void *dec)
+{
+    return ((struct bats_decoder_ref *) dec)->overhead;
+}
+
+static long long ref_operations(void *dec)
+{
+    return ((struct bats_decoder_ref *) dec)->operations;
+}
+
+static GF_ELEMENT **ref_packets(void *dec)
+{
+    return ((struct bats_decoder_ref *) dec)->pp;
+}
+
+const struct bats_decoder_ops bats_decoder_ref_ops = {
+    ref_process, ref_finished, ref_DoF, ref_reset,
+    ref_free, ref_overhead, ref_operations, ref_packets,
+};
+
+// A packet is decoded once its row is a unit vector. Such a row is never replaced, as no
+// nonzero vector is sparser.
+static void check_decoded(struct bats_decoder_ref *dec_ctx, int i)
+{
+    struct row_vector *row = dec_ctx->row[i];
+    if (row->nz != 1 || dec_ctx->pp[i] != NULL)
+        return;
+    if (row->elem[0] != 1) {
+        galois_multiply_region(dec_ctx->message[i], galois_divide(1, row->elem[0]), dec_ctx->param->pktsize);
+        dec_ctx->operations += 1 + dec_ctx->param->pktsize;
+        row->elem[0] = 1;
+    }
+    dec_ctx->pp[i] = dec_ctx->message[i];
+    if (i < dec_ctx->param->snum)
+        dec_ctx->decoded += 1;
+}
+
+// Release decoded source packets in order
+static void release_packets(struct bats_decoder_ref *dec_ctx)
+{
+    while (dec_ctx->released < dec_ctx->param->snum && dec_ctx->pp[dec_ctx->released] != NULL) {
+        if (dec_ctx->deliver != NULL)
+            dec_ctx->deliver(dec_ctx->deliver_arg, dec_ctx->released, dec_ctx->pp[dec_ctx->released]);
+        dec_ctx->released += 1;
+    }
+}
+
+// Allocate a zero-filled arena. Pages are only backed when they are touched, and are
+// backed by huge pages if BATS_HUGEPAGES is set.
+static void *alloc_arena(size_t size)
+{
+    void *p = mmap(NULL, size > 0 ? size : 1, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+#if defined(MADV_HUGEPAGE)
+    if (getenv("BATS_HUGEPAGES") != NULL)
+        madvise(p, size, MADV_HUGEPAGE);
+#endif
+    return p;
+}
+
+static void free_arena(void *p, size_t size)
+{
+    if (p != NULL)
+        munmap(p, size > 0 ? size : 1);
 }
@@ -23,15 +23,21 @@ BATSencoder *bats_create_encoder(unsigned char *buf, BATSparam *param)
     // init mt19937 RNG
     init_genrand(param->seed);
     // calculate number of source packets after padding 0 (in case)
-    param->snum = ALIGN(param->datasize, param->pktsize);
+    // In rank-only mode (pktsize is 0), packets have no payload and snum is taken as given.
+    if (param->pktsize != 0)
+        param->snum = ALIGN(param->datasize, param->pktsize);
     // create bipartite graph
     if (param->cnum != 0) {
-        if ( (ctx->graph = malloc(sizeof(BP_graph))) == NULL ) {
-            fprintf(stderr, "%s: malloc BP_graph\n", fname);
+        if ( (ctx->graph = acquire_bipartite_graph(param->snum, param->cnum, param->seed)) == NULL ) {
+            fprintf(stderr, "%s: create BP_graph failed\n", fname);
             return NULL;
         }
-        if (create_bipartite_graph(ctx->graph, param->snum, param->cnum) < 0)
+    }
+    if (param->hnum != 0) {
+        if ( (ctx->hdpc = create_hdpc_matrix(param->hnum, param->snum+param->cnum, param->seed)) == NULL ) {
+            fprintf(stderr, "%s: create HDPC matrix failed\n", fname);
             return NULL;
+        }
     }
     ctx->batnum = 0;
     ctx->currbat = NULL;
@@ -39,7 +45,7 @@ BATSencoder *bats_create_encoder(unsigned char *buf, BATSparam *param)
     constructField();   // Construct Galois Field
 
     // load source packets and perform precoding
-    if ((ctx->pp = calloc(param->snum+param->cnum, sizeof(GF_ELEMENT*))) == NULL) {
+    if ((ctx->pp = calloc(param->snum+param->cnum+param->hnum, sizeof(GF_ELEMENT*))) == NULL) {
         fprintf(stderr, "%s: calloc ctx->pp\n", fname);
         //bats_free_encoder(ctx);
         return NULL;
@@ -56,7 +62,7 @@ BATSencoder *bats_create_encoder(unsigned char *buf, BATSparam *param)
             alread += toread;
         }
         // Allocate parity-check packet space
-        for (i=0; i<param->cnum; i++)
+        for (i=0; i<param->cnum+param->hnum; i++)
             ctx->pp[param->snum+i] = calloc(param->pktsize, sizeof(GF_ELEMENT));
         bats_precoding(ctx);
     }
@@ -65,6 +71,18 @@ BATSencoder *bats_create_encoder(unsigned char *buf, BATSparam *param)
     return ctx;
 }
 
+// Restore the encoder as just created for another transfer of the same data. The source and
+// precoded packets are kept, and the RNG is reseeded as bats_create_encoder() does.
+void bats_reset_encoder(BATSencoder *ctx)
+{
+    init_genrand(ctx->param->seed);
+    if (ctx->currbat != NULL) {
+        bats_free_batch(ctx->currbat);
+        ctx->currbat = NULL;
+    }
+    ctx->batnum = 0;
+}
+
 
 static void bats_precoding(BATSencoder *ctx)
 {
@@ -73,15 +91,19 @@ static void bats_precoding(BATSencoder *ctx)
     int i, j;
     for (i=0; i<ctx->param->cnum; i++) {
         // Encoding check packet according to the LDPC graph
-        NBR_node *nb = ctx->graph->l_nbrs_of_r[i]->first;
-        while(nb != NULL) {
-            int sid = nb->data;  // index of source packet
+        BP_graph *graph = ctx->graph;
+        for (j=graph->l_of_r_off[i]; j<graph->l_of_r_off[i+1]; j++) {
+            int sid = graph->l_of_r_idx[j];  // index of source packet
             // XOR information content
-            galois_multiply_add_region(ctx->pp[i+ctx->param->snum], ctx->pp[sid], nb->ce, ctx->param->pktsize);
-            // move to next possible neighbour node of current check
-            nb = nb->next;
+            galois_multiply_add_region(ctx->pp[i+ctx->param->snum], ctx->pp[sid], graph->l_of_r_ce[j], ctx->param->pktsize);
         }
     }
+    // HDPC packets are dense combinations of the source and LDPC packets
+    int ncol = ctx->param->snum + ctx->param->cnum;
+    for (i=0; i<ctx->param->hnum; i++) {
+        for (j=0; j<ncol; j++)
+            galois_multiply_add_region(ctx->pp[ncol+i], ctx->pp[j], ctx->hdpc[(size_t) i*ncol+j], ctx->param->pktsize);
+    }
 }
 
 // Generate a new batch from soruce/intermediate packets
@@ -100,7 +122,7 @@ BATSbatch *bats_start_new_batch(BATSencoder *ctx, int batchid, int degree, int b
     batch->sent = 0;
     batch->pktid = malloc(sizeof(int)*batch->degree);
     // uniformatly randomly draw packets from source/intermediate packets using Fisher-Yates algo.
-    get_random_unique_numbers(batch->pktid, batch->degree, ctx->param->snum+ctx->param->cnum);
+    get_random_unique_numbers(batch->pktid, batch->degree, ctx->param->snum+ctx->param->cnum+ctx->param->hnum);
     ctx->currbat = batch;
     ctx->batnum += 1;
     return batch;
@@ -190,7 +212,7 @@ BATSpacket *bats_alloc_batch_packet(BATSencoder *ctx)
     if (pkt->coes == NULL)
         goto AllocErr;
     pkt->syms = calloc(ctx->param->pktsize, sizeof(GF_ELEMENT));
-    if (pkt->syms == NULL)
+    if (pkt->syms == NULL && ctx->param->pktsize != 0)
         goto AllocErr;
 
     return pkt;
@@ -223,18 +245,21 @@ void bats_free_batch(BATSbatch *batch)
 
 void bats_free_encoder(BATSencoder *ctx)
 {
-    free_bipartite_graph(ctx->graph);
+    release_bipartite_graph(ctx->graph);
     ctx->graph = NULL;
     if (ctx->currbat != NULL) {
         bats_free_batch(ctx->currbat);
         ctx->currbat = NULL;
     }
-    for (int i=0; i<ctx->param->snum+ctx->param->cnum; i++) {
+    free(ctx->hdpc);
+    ctx->hdpc = NULL;
+    for (int i=0; i<ctx->param->snum+ctx->param->cnum+ctx->param->hnum; i++) {
         free(ctx->pp[i]);
         ctx->pp[i] = NULL;
     }
     free(ctx->pp);
     // free(ctx->param);
+    free(ctx);
 }
 
 void bats_free_packet(BATSpacket *pkt)
@@ -250,3 +275,9 @@ void bats_free_packet(BATSpacket *pkt)
     free(pkt);
     return;
 }
+
+// Free a packet held as void *, e.g., by a channel
+void bats_release_packet(void *pkt)
+{
+    bats_free_packet((BATSpacket *) pkt);
+}
@@ -41,6 +41,21 @@ BATSbuffer *bats_create_buffer(BATSparam *param, int bufsize)
     return buf;
 }
 
+// Empty the buffer as just created
+void bats_reset_buffer(BATSbuffer *buf)
+{
+    for (int i=0; i<buf->bufsize; i++) {
+        if (buf->srbuf[i] != NULL) {
+            bats_free_packet(buf->srbuf[i]);
+            buf->srbuf[i] = NULL;
+        }
+    }
+    buf->sbatchid = -1;
+    buf->currbts = -1;
+    buf->s_first = -1;
+    buf->r_last = -1;
+}
+
 void bats_buffer_packet(BATSbuffer *buf, BATSpacket *pkt)
 {
     int pos = -1;   // Pos index where new packet is stored
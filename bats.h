@@ -12,8 +12,9 @@ typedef struct bats_parameter {
     int         datasize;           // data size
     int         snum;               // number of source packets
     int         cnum;               // number of parity-check packets
-    int         pktsize;            // packet content size
+    int         pktsize;            // packet content size, 0 to simulate ranks only
     int         seed;               // RNG seed
+    int         hnum;               // number of HDPC packets after the parity-check packets
 } BATSparam;
 
 typedef struct bats_batch {
@@ -27,6 +28,7 @@ typedef struct bats_batch {
 typedef struct bats_encoder_context {
     BATSparam   *param;
     BP_graph    *graph;
+    GF_ELEMENT  *hdpc;              // HDPC matrix, hnum x (snum+cnum)
     int         batnum;             // number of batches generated so far
     BATSbatch   *currbat;           // current batch
     GF_ELEMENT  **pp;               // pointers to precoded source packets
@@ -44,6 +46,7 @@ typedef struct bats_packet {
 
 // Encoder
 BATSencoder *bats_create_encoder(unsigned char *buf, BATSparam *param);
+void bats_reset_encoder(BATSencoder *ctx);
 BATSbatch *bats_start_new_batch(BATSencoder *ctx, int batchid, int degree, int bts);
 BATSpacket *bats_encode_packet(BATSencoder *ctx);
 void bats_encode_packet_im(BATSencoder *ctx, BATSpacket *pkt);
@@ -51,6 +54,7 @@ BATSpacket *bats_duplicate_packet(BATSencoder *ctx, BATSpacket *pkt);
 BATSpacket *bats_alloc_batch_packet(BATSencoder *ctx);
 void bats_free_batch(BATSbatch *batch);
 void bats_free_packet(BATSpacket *pkt);
+void bats_release_packet(void *pkt);
 void bats_free_encoder(BATSencoder *ctx);
 
 
@@ -81,6 +85,7 @@ typedef struct bats_buffer {
 } BATSbuffer;
 
 BATSbuffer *bats_create_buffer(BATSparam *param, int bufsize);
+void bats_reset_buffer(BATSbuffer *buf);
 void bats_buffer_packet(BATSbuffer *buf, BATSpacket *pkt);
 BATSpacket *bats_recode_packet(BATSbuffer *buf);
 void visualize_buffer(BATSbuffer *buf);
@@ -92,8 +97,11 @@ void bats_free_buffer(BATSbuffer *buf);
 struct row_vector
 {
     int len;            // length of the row
-    GF_ELEMENT *elem;   // elements of the row
-} ROW;
+    int nz;             // number of nonzero elements of the row
+    int nzlen;          // length between the leading element and the last nonzero
+    int *idx;           // offsets of nonzeros to the leading element if the row is sparse, NULL otherwise
+    GF_ELEMENT *elem;   // elements of the row (only the nonzeros if the row is sparse)
+};
 
 // Reference decoder context
 struct bats_decoder_ref {
@@ -105,12 +113,42 @@ struct bats_decoder_ref {
     int                 DoF;                // innovative coded packets
     int                 *seen;              // 0/1 array to indicate whether a packet has been included in at least one received batch
     int                 covered;            // covered packets in the received batches
+    int                 *colnz;             // number of rows of the decoding matrix having nonzero at each column
+    int                 rowcovered;         // columns having nonzero in some row of the decoding matrix
     int                 de_precode;         // whether applied parity-check vectors?
+    GF_ELEMENT          *hdpc;              // HDPC matrix, hnum x (snum+cnum)
     int                 finished;           // whether finished decoding
     long long           operations;         // finite field operations 
     struct row_vector   **row;              // rows of decoding matrix
     GF_ELEMENT          **message;          // rows of message symbols
-    GF_ELEMENT          **pp;               // recovered packets
+    GF_ELEMENT          **pp;               // recovered packets, pointing to rows of message; NULL if not decoded yet
+
+    // Packets are decoded as soon as their rows are reduced to unit vectors, and decoded
+    // source packets are released in order.
+    int                 decoded;            // decoded source packets
+    int                 released;           // source packets 0, ..., released-1 have been released
+    void                (*deliver)(void *arg, int id, GF_ELEMENT *pkt);     // called as each source packet is released
+    void                *deliver_arg;
+
+    // Rows of the decoding matrix and of message symbols are kept in arenas of fixed row
+    // stride, and are addressed by pivot index.
+    struct row_vector   *rows;              // row[i] points to rows[i] once pivot i is found
+    GF_ELEMENT          *coef;              // elements of dense rows, row i at coef+i*coef_stride+i
+    GF_ELEMENT          *msgs;              // message[i] is msgs+i*msg_stride
+    size_t              coef_stride;
+    size_t              msg_stride;
+
+    // Scratch space of the vector being processed. A vector (and a stored row) is kept
+    // as sorted index/value pairs while it has at most maxnz nonzeros, and is switched
+    // to full length once fill-in exceeds that.
+    int                 maxnz;
+    int                 *sp_idx[2];
+    GF_ELEMENT          *sp_val[2];
+    GF_ELEMENT          *full;
+    // Row operations on a zero message (of a parity-check vector) are deferred until
+    // the message is needed, and are dropped if the vector turns out non-innovative.
+    int                 *pend_row;
+    GF_ELEMENT          *pend_q;
 
     // A small matrix storing vectors of the receiving batch. Received vectors are processed
     // against the previously vectors of the same batch, which renders the vector sparser.
@@ -121,8 +159,87 @@ struct bats_decoder_ref {
 };
 
 struct bats_decoder_ref *bats_create_decoder_ref(BATSparam *param);
+void bats_reset_decoder_ref(struct bats_decoder_ref *decoder);
 void bats_free_decoder_ref(struct bats_decoder_ref *decoder);
 int bats_process_packet_ref(struct bats_decoder_ref *dec_ctx, BATSpacket *pkt);
+void bats_set_delivery_ref(struct bats_decoder_ref *dec_ctx, void (*deliver)(void *arg, int id, GF_ELEMENT *pkt), void *arg);
+
+// Belief-propagation (BP) decoder
+
+// Received packets of a batch
+struct bp_batch {
+    int                 degree;             // number of packets in the batch
+    int                 *pktid;             // packet id of the batch
+    int                 nrow;               // number of innovative packets received from the batch
+    int                 *pivrow;            // received packet whose leading coefficient is at the position, -1 if none
+    GF_ELEMENT          **row;              // coding coefficients of the received packets (echelon form)
+    GF_ELEMENT          **msg;              // content of the received packets
+    int                 undecoded;          // number of packets of the batch not decoded yet
+    int                 solved;             // whether all packets of the batch are decoded
+};
+
+// BP decoder context
+struct bats_decoder_bp {
+    BATSparam           *param;             // BATS code parameter
+    BP_graph            *graph;             // bipartite graph of precode
+    GF_ELEMENT          *hdpc;              // HDPC matrix, hnum x (snum+cnum)
+
+    int                 received;           // received coded packets
+    int                 overhead;           // received coded packets
+    int                 DoF;                // innovative coded packets (within their own batches)
+    int                 decoded;            // decoded source packets
+    int                 finished;           // whether finished decoding
+    long long           operations;         // finite field operations
+    GF_ELEMENT          **pp;               // recovered packets, NULL in rank-only mode (pktsize 0)
+    char                *known;             // whether each packet is decoded
+
+    int                 nbatch;             // size of the batch array
+    struct bp_batch     **batch;            // batches indexed by batch id
+    int                 *nbat_of;           // number of undecoded batches each packet is involved in
+    int                 *bat_of_size;       // allocated size of bat_of[i]
+    int                 **bat_of;           // ids of the batches each packet is involved in
+    int                 *unknown;           // number of undecoded packets of each parity-check
+    int                 *queue;             // decoded packets whose neighbours are to be updated
+    int                 qhead;
+    int                 qtail;
+
+    // Inactivation decoding: when BP stalls, some packets are inactivated so that peeling can go
+    // on, and the inactivated packets are solved by dense Gaussian elimination in the end.
+    int                 inactivation;       // whether inactivation decoding is enabled
+    int                 inactivated;        // number of inactivated packets of the successful attempt
+    struct inac_state   *inac;              // coefficient-only inactivation kept between packets, NULL if none
+    int                 inac_next;          // DoF before which no new inactivation attempt can succeed
+
+    int                 released;           // source packets 0, ..., released-1 have been released
+    void                (*deliver)(void *arg, int id, GF_ELEMENT *pkt);     // called as each source packet is released
+    void                *deliver_arg;
+};
+
+struct bats_decoder_bp *bats_create_decoder_bp(BATSparam *param);
+struct bats_decoder_bp *bats_create_decoder_inac(BATSparam *param);
+void bats_reset_decoder_bp(struct bats_decoder_bp *decoder);
+void bats_free_decoder_bp(struct bats_decoder_bp *decoder);
+int bats_process_packet_bp(struct bats_decoder_bp *dec_ctx, BATSpacket *pkt);
+void bats_set_delivery_bp(struct bats_decoder_bp *dec_ctx, void (*deliver)(void *arg, int id, GF_ELEMENT *pkt), void *arg);
+
+// Decoders behind a common interface, so that a node can run any of them
+struct bats_decoder_ops {
+    int         (*process)(void *dec, BATSpacket *pkt);     // 1 if the packet is innovative
+    int         (*finished)(void *dec);
+    int         (*DoF)(void *dec);                          // innovative coded packets
+    void        (*reset)(void *dec);                        // restore the decoder as just created
+    void        (*free)(void *dec);
+    int         (*overhead)(void *dec);                     // received coded packets
+    long long   (*operations)(void *dec);                   // finite field operations
+    GF_ELEMENT  **(*packets)(void *dec);                    // recovered packets
+};
+extern const struct bats_decoder_ops bats_decoder_ref_ops;
+extern const struct bats_decoder_ops bats_decoder_bp_ops;   // of both the BP and inactivation decoders
+
+struct bats_decoder {
+    void                            *ctx;   // struct bats_decoder_ref or struct bats_decoder_bp
+    const struct bats_decoder_ops   *ops;
+};
 
 // Reinforcement learning functions
 int derive_e_greedy_action_SGD(double r_ratio, int isgreedy);
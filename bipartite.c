@@ -12,14 +12,74 @@
  *----------------------------------------------------------*/
 #include <math.h>
 #include <string.h>
+#include <pthread.h>
 #include "bipartite.h"
 extern unsigned long genrand_int32(void);
 static int is_prime(int number);
 static int include_left_node(int l_index, int r_index, BP_graph *graph);
-static void append_to_list(struct node_list *list, struct node *nd);
-static int exist_in_list(struct node_list *list, int data);
-static void clear_list(struct node_list *list);
-static void free_list(struct node_list *list);
+static int index_right_nodes(BP_graph *graph);
+static void free_edges(BP_graph *graph);
+
+#define LDPC_DEGREE 3   // number of check nodes a left node connects to
+#define GRAPH_CACHE 8   // number of graphs kept after they are released
+
+// Graphs are immutable once created, so encoders and decoders of the same code share one
+// graph, which is also kept for the later contexts after it is released.
+static BP_graph *graph_cache[GRAPH_CACHE];
+static pthread_mutex_t graph_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Get the LDPC graph of nleft and nright nodes, which is created only if it's not cached.
+// A graph with non-binary coefficients draws them from MT19937, which the caller is expected
+// to have seeded with seed.
+BP_graph *acquire_bipartite_graph(int nleft, int nright, int seed)
+{
+    int i;
+    BP_graph *graph = NULL;
+    pthread_mutex_lock(&graph_lock);
+    for (i=0; i<GRAPH_CACHE; i++) {
+        BP_graph *g = graph_cache[i];
+        if (g != NULL && g->nleft == nleft && g->nright == nright && g->seed == seed) {
+            graph = g;
+            graph->refcount += 1;
+            goto Unlock;
+        }
+    }
+    if ((graph = malloc(sizeof(BP_graph))) == NULL)
+        goto Unlock;
+    if (create_bipartite_graph(graph, nleft, nright) < 0) {
+        free(graph);
+        graph = NULL;
+        goto Unlock;
+    }
+    graph->seed = seed;
+    graph->refcount = 1;
+    graph->cached = 0;
+    // take an empty slot, or else evict a graph nobody is using
+    for (i=0; i<GRAPH_CACHE; i++) {
+        if (graph_cache[i] == NULL || graph_cache[i]->refcount == 0) {
+            if (graph_cache[i] != NULL)
+                free_bipartite_graph(graph_cache[i]);
+            graph_cache[i] = graph;
+            graph->cached = 1;
+            break;
+        }
+    }
+Unlock:
+    pthread_mutex_unlock(&graph_lock);
+    return graph;
+}
+
+// Release a graph from acquire_bipartite_graph. It's freed unless it's cached.
+void release_bipartite_graph(BP_graph *graph)
+{
+    if (graph == NULL)
+        return;
+    pthread_mutex_lock(&graph_lock);
+    graph->refcount -= 1;
+    if (graph->refcount == 0 && !graph->cached)
+        free_bipartite_graph(graph);
+    pthread_mutex_unlock(&graph_lock);
+}
 
 // construct LDPC graph
 int create_bipartite_graph(BP_graph *graph, int nleft, int nright)
@@ -33,21 +93,18 @@ int create_bipartite_graph(BP_graph *graph, int nleft, int nright)
     graph->nleft  = nleft;
     graph->nright = nright;
     graph->binaryce = 1;
-    if ((graph->l_nbrs_of_r = calloc(nright, sizeof(NBR_nodes*))) == NULL)
-        goto failure;
-    for (i=0; i<nright; i++) {
-        if ((graph->l_nbrs_of_r[i] = malloc(sizeof(NBR_nodes))) == NULL)
-            goto failure;
-        graph->l_nbrs_of_r[i]->first = graph->l_nbrs_of_r[i]->last = NULL;
-    }
-
-    if ((graph->r_nbrs_of_l = calloc(nleft, sizeof(NBR_nodes*))) == NULL)
+    graph->nedge  = 0;
+    graph->l_of_r_idx = NULL;
+    graph->l_of_r_ce  = NULL;
+    // Edges are recorded at the left nodes, which are included in increasing order. Until
+    // the graph is complete, r_of_l_off[l+1] holds the number of neighbours of left node l.
+    graph->l_of_r_off = calloc(nright+1, sizeof(int));
+    graph->r_of_l_off = calloc(nleft+1, sizeof(int));
+    graph->r_of_l_idx = malloc((size_t) LDPC_DEGREE * nleft * sizeof(int));
+    graph->r_of_l_ce  = malloc((size_t) LDPC_DEGREE * nleft * sizeof(unsigned char));
+    if (graph->l_of_r_off == NULL || graph->r_of_l_off == NULL
+            || graph->r_of_l_idx == NULL || graph->r_of_l_ce == NULL)
         goto failure;
-    for (i=0; i<nleft; i++) {
-        if ((graph->r_nbrs_of_l[i] = malloc(sizeof(NBR_nodes))) == NULL)
-            goto failure;
-        graph->r_nbrs_of_l[i]->first = graph->r_nbrs_of_l[i]->last = NULL;
-    }
 
     // By default use circulant LDPC code which is used by Raptor code
     int a, b;
@@ -90,22 +147,32 @@ int create_bipartite_graph(BP_graph *graph, int nleft, int nright)
                 goto failure;
         }
     }
+    for (i=0; i<nleft; i++)
+        graph->r_of_l_off[i+1] += graph->r_of_l_off[i];
+    if (index_right_nodes(graph) < 0)
+        goto failure;
     return 0;
 
 failure:
-    free_bipartite_graph(graph);
+    // the graph itself belongs to the caller
+    free_edges(graph);
     return -1;
 }
 
 // include left node index in the LDPC graph
 static int include_left_node(int l_index, int r_index, BP_graph *graph)
 {
-    // Skip if the two nodes are already neighbors
+    // Skip if the two nodes are already neighbors. Edges of l_index are the latest ones.
     // Note: a good ``bipartitin'' algorithm should not get into such 
     // trouble. This is included just in case we needed to test/experiment
     // different bipartite creating methods.
-    if (exist_in_list(graph->l_nbrs_of_r[r_index], l_index))
-        return 0;
+    int n = graph->r_of_l_off[l_index+1];
+    for (int k=graph->nedge-n; k<graph->nedge; k++) {
+        if (graph->r_of_l_idx[k] == r_index)
+            return 0;
+    }
+    if (n == LDPC_DEGREE)
+        return -1;
     // Coding coefficient associated with the edge
     unsigned char ce;
     if (graph->binaryce == 1) {
@@ -113,85 +180,76 @@ static int include_left_node(int l_index, int r_index, BP_graph *graph)
     } else {
         ce = (unsigned char) (genrand_int32() % 255 + 1); // Value range: [1-255]
     }
-    // Record neighbor of a right-side node
-    NBR_node *nb = calloc(1, sizeof(NBR_node));
-    if (nb == NULL)
-        return -1;
-    nb->data = l_index;
-    nb->ce   = ce;
-    nb->next = NULL;
-    append_to_list(graph->l_nbrs_of_r[r_index], nb);
-
-    // Also neighbour of the left-side node
-    NBR_node *check_nb = calloc(1, sizeof(NBR_node));
-    if (nb == NULL)
-        return -1;
-    check_nb->data = r_index;
-    check_nb->ce   = ce;
-    check_nb->next = NULL;
-    append_to_list(graph->r_nbrs_of_l[l_index], check_nb);
+    // Record neighbor of the left-side node
+    graph->r_of_l_idx[graph->nedge] = r_index;
+    graph->r_of_l_ce[graph->nedge]  = ce;
+    graph->nedge += 1;
+    graph->r_of_l_off[l_index+1] += 1;
     return 0;
 }
 
-void free_bipartite_graph(BP_graph *graph)
+// Build the neighbours of right-side nodes from those of left-side nodes by counting sort,
+// which keeps the left nodes of each right node in increasing order.
+static int index_right_nodes(BP_graph *graph)
 {
-    if (graph == NULL)
-        return;
-    int i;
-    if (graph->r_nbrs_of_l != NULL) {
-        for (i=0; i<graph->nleft; i++)
-            free_list(graph->r_nbrs_of_l[i]);
-        free(graph->r_nbrs_of_l);
+    int i, k;
+    graph->l_of_r_idx = malloc(graph->nedge * sizeof(int) + 1);
+    graph->l_of_r_ce  = malloc(graph->nedge * sizeof(unsigned char) + 1);
+    int *pos = malloc(graph->nright * sizeof(int));
+    if (graph->l_of_r_idx == NULL || graph->l_of_r_ce == NULL || pos == NULL) {
+        free(pos);
+        return -1;
     }
-    if (graph->l_nbrs_of_r != NULL) {
-        for (i=0; i<graph->nright; i++)
-            free_list(graph->l_nbrs_of_r[i]);
-        free(graph->l_nbrs_of_r);
+    for (k=0; k<graph->nedge; k++)
+        graph->l_of_r_off[graph->r_of_l_idx[k]+1] += 1;
+    for (i=0; i<graph->nright; i++) {
+        graph->l_of_r_off[i+1] += graph->l_of_r_off[i];
+        pos[i] = graph->l_of_r_off[i];
     }
-    free(graph);
-}
-
-static void append_to_list(struct node_list *list, struct node *nd)
-{
-    if (list->first == NULL)
-        list->first = list->last = nd;
-    else {
-        list->last->next = nd;
-        list->last = nd;
+    for (i=0; i<graph->nleft; i++) {
+        for (k=graph->r_of_l_off[i]; k<graph->r_of_l_off[i+1]; k++) {
+            int r = graph->r_of_l_idx[k];
+            graph->l_of_r_idx[pos[r]] = i;
+            graph->l_of_r_ce[pos[r]++] = graph->r_of_l_ce[k];
+        }
     }
+    free(pos);
+    return 0;
 }
 
-static int exist_in_list(struct node_list *list, int data)
+// Create the dense GF(256) matrix of the HDPC (high density parity-check) stage, which is
+// applied after the LDPC stage as in RaptorQ. Row h gives the coefficients of HDPC packet h
+// over the ncol source and LDPC packets. The coefficients are drawn from a xorshift generator
+// of its own, so that the MT19937 stream of the caller is not disturbed.
+unsigned char *create_hdpc_matrix(int nrow, int ncol, int seed)
 {
-    struct node *p = list->first;
-    while (p != NULL) {
-        if (p->data == data)
-            return 1;
-        p = p->next;
+    unsigned char *hdpc = malloc((size_t) nrow * ncol * sizeof(unsigned char));
+    if (hdpc == NULL)
+        return NULL;
+    unsigned long x = 2463534242UL ^ (unsigned long) seed;
+    for (size_t i=0; i<(size_t) nrow * ncol; i++) {
+        x ^= (x << 13) & 0xffffffffUL;
+        x ^= x >> 17;
+        x ^= (x << 5) & 0xffffffffUL;
+        hdpc[i] = (unsigned char) (x >> 24);
     }
-    return 0;
+    return hdpc;
 }
 
-// clear nodes in a list, but keep the list structure alive
-static void clear_list(struct node_list *list)
+void free_bipartite_graph(BP_graph *graph)
 {
-    struct node *nd = list->first;
-    struct node *ndNext;
-    while (nd != NULL) {
-        ndNext = nd->next;
-        free(nd);
-        nd = ndNext;
-    }
-    list->first = list->last = NULL;
+    if (graph == NULL)
+        return;
+    free_edges(graph);
+    free(graph);
 }
 
-// Free a list, which include clear nodes in a list and free
-// the list structure in the end.
-static void free_list(struct node_list *list)
+static void free_edges(BP_graph *graph)
 {
-    if (list != NULL) {
-        clear_list(list);
-        free(list);
-    }
+    free(graph->l_of_r_off);
+    free(graph->l_of_r_idx);
+    free(graph->l_of_r_ce);
+    free(graph->r_of_l_off);
+    free(graph->r_of_l_idx);
+    free(graph->r_of_l_ce);
 }
-
@@ -1,25 +1,26 @@
 #include <stdlib.h>
-// node of singly linked list
-typedef struct node {
-    int data;
-    unsigned char ce;     // coefficient associated with node's data (for bipartite graph)
-    struct node *next;
-} NBR_node;
-
-typedef struct node_list {
-    struct node *first;
-    struct node *last;
-} NBR_nodes;
-
-// Bipartitle graph
+// Bipartitle graph, in compressed-sparse-row form. Left side neighbours of right node r are
+// l_of_r_idx[l_of_r_off[r]] ... l_of_r_idx[l_of_r_off[r+1]-1], with edge coefficients in
+// l_of_r_ce. Right side neighbours of left nodes are stored likewise in r_of_l_*.
 typedef struct bipartite_graph {
     int         nleft;
     int         nright;
     int         binaryce;       // Whether coefficients of edges are 1 or higher order
-    NBR_nodes **l_nbrs_of_r;    // left side neighbours of right
-    NBR_nodes **r_nbrs_of_l;    // right side neighbours of left
+    int         nedge;          // number of edges
+    int         seed;           // RNG seed the graph was created with
+    int         refcount;       // number of contexts sharing the graph, see acquire_bipartite_graph
+    int         cached;         // whether the graph is kept in the graph cache
+    int           *l_of_r_off;  // left side neighbours of right, nright+1 offsets
+    int           *l_of_r_idx;
+    unsigned char *l_of_r_ce;
+    int           *r_of_l_off;  // right side neighbours of left, nleft+1 offsets
+    int           *r_of_l_idx;
+    unsigned char *r_of_l_ce;
 } BP_graph;
 
 /* bipartite.c */
 int create_bipartite_graph(BP_graph *graph, int nleft, int nright);
 void free_bipartite_graph(BP_graph *graph);
+BP_graph *acquire_bipartite_graph(int nleft, int nright, int seed);
+void release_bipartite_graph(BP_graph *graph);
+unsigned char *create_hdpc_matrix(int nrow, int ncol, int seed);
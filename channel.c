@@ -1,84 +1,640 @@
+#define _DEFAULT_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(INTEL_AVX2)
+#include <immintrin.h>
+#endif
 #include "channel.h"
 
+static inline uint32_t stream_hash(uint32_t key, uint32_t ctr);
+static void hash_block(uint32_t key, uint32_t ctr, int n, uint32_t *out);
+static void sample_markov(struct channel *chnl, uint32_t ctr, int n, uint64_t *bitmap);
+static uint64_t threshold(double p);
+static int trace_delay(struct channel *chnl);
+static int erased(struct channel *chnl);
+static int place_packet(struct channel *chnl, void *packet, int t, int delay);
+static int reserve_ring(struct channel *chnl, int delay);
 
-struct channel *create_channel(int delay, double pe)
+// Create a channel, whose RNG stream is keyed by the libc RNG, so that channels are
+// reproducible by srand() of the simulator.
+struct channel *create_channel(int delay, int maxdelay, double pe)
+{
+    return create_channel_seeded(delay, maxdelay, pe, (uint32_t) rand());
+}
+
+struct channel *create_channel_seeded(int delay, int maxdelay, double pe, uint32_t seed)
 {
     struct channel *ch = malloc(sizeof(struct channel));
     ch->delay = delay;
     ch->pe    = pe;
-    ch->queue = calloc(delay+1, sizeof(void*));
+    ch->ring  = NULL;
+    ch->ringlen = 0;
+    ch->release = free;
+    if (reserve_ring(ch, delay > maxdelay ? delay : maxdelay) < 0) {
+        free(ch);
+        return NULL;
+    }
+    ch->key   = stream_hash(seed, 0x5bd1e995);
+    ch->ctr   = 0;
+    ch->sampled = 0;
+    ch->model = NULL;
+    ch->trace = NULL;
+    ch->rate  = RATE_ONE;
+    ch->depth = RATE_ONE;
+    ch->tokens = RATE_ONE;
+    ch->tfill = 0;
+    ch->fifo  = NULL;
+    ch->qcap  = 0;
+    ch->qhead = 0;
+    ch->qsize = 0;
     return ch;
 }
 
 void free_channel(struct channel *chnl)
 {
-    free(chnl->queue);
+    for (int i=0; i<chnl->ringlen; i++) {
+        if (chnl->ring[i].packet != NULL)
+            chnl->release(chnl->ring[i].packet);
+    }
+    void *packet;
+    while ((packet = dequeue_from_channel(chnl)) != NULL)
+        chnl->release(packet);
+    free(chnl->fifo);
+    free_loss_model(chnl->model);
+    free(chnl->ring);
     free(chnl);
     chnl = NULL;
 }
 
+// Restore the channel as just created, keeping its delay, erasure probability, loss model,
+// trace and rate. Packets in flight or in the queue are released.
+void reset_channel(struct channel *chnl)
+{
+    reset_channel_seeded(chnl, (uint32_t) rand());
+}
+
+void reset_channel_seeded(struct channel *chnl, uint32_t seed)
+{
+    for (int i=0; i<chnl->ringlen; i++) {
+        if (chnl->ring[i].packet != NULL) {
+            chnl->release(chnl->ring[i].packet);
+            chnl->ring[i].packet = NULL;
+        }
+    }
+    void *packet;
+    while ((packet = dequeue_from_channel(chnl)) != NULL)
+        chnl->release(packet);
+    chnl->qhead = 0;
+    chnl->key   = stream_hash(seed, 0x5bd1e995);
+    chnl->ctr   = 0;
+    chnl->sampled = 0;
+    chnl->mstate = chnl->mnext = 0;
+    chnl->mblock = 0;
+    chnl->tokens = RATE_ONE;
+    chnl->tfill = 0;
+    if (chnl->trace != NULL)
+        set_channel_trace(chnl, chnl->trace, chnl->tstart, chnl->tloop);   // a random offset is drawn again
+}
+
+void set_channel_release(struct channel *chnl, void (*release)(void *packet))
+{
+    chnl->release = release;
+}
+
 // Return whether the packet will be erased. If erased, it's the
 // caller's responsibility to free the packet, as we have no idea
 // about the packet's implementation (we always treat it as void)
 int send_to_channel(struct channel *chnl, void *packet, int t)
 {
-    int queue_len = chnl->delay + 1;
-    int lost = 0;
-    int pos = (t+chnl->delay) % queue_len;      // where to put the packet in the queue 
-    if (chnl->queue[pos] != NULL) {
-        free(chnl->queue[pos]);                 // Warning: there might be memory leak here, but don't care it
-    }
-    if (rand() % 10000 <= chnl->pe * 10000) {
-        lost = 1;
-        chnl->queue[pos] = NULL;
-        // printf("Element sent at time %d is lost\n", t);
-    } else {
-        chnl->queue[pos] = packet;
-    }    
-    return lost;
+    int delay = channel_transit(chnl);
+    if (delay < 0)
+        return 1;
+    return place_packet(chnl, packet, t, delay);
+}
+
+int send_to_channel_delayed(struct channel *chnl, void *packet, int t, int delay)
+{
+    if (chnl->trace != NULL)
+        delay = trace_delay(chnl);
+    else if (erased(chnl))
+        delay = -1;
+    if (delay < 0)
+        return 1;
+    return place_packet(chnl, packet, t, delay);
+}
+
+int channel_transit(struct channel *chnl)
+{
+    if (chnl->trace != NULL)
+        return trace_delay(chnl);
+    return erased(chnl) ? -1 : chnl->delay;
 }
 
 void *recv_from_channel(struct channel *chnl, int t)
 {
-    if (t < chnl->delay) {
+    struct inflight *e = &chnl->ring[t & (chnl->ringlen-1)];
+    if (e->packet == NULL || e->arrival != t)
         return NULL;
-    }
-    int queue_len = chnl->delay + 1;
-    int pos = t % queue_len;      // where to pick the packet in the queue 
-    void *out = chnl->queue[pos];
-    chnl->queue[pos] = NULL;
+    void *out = e->packet;
+    e->packet = NULL;
     return out;
 }
 
-// Modify channel characteristics
-// Important to realloc memory for queue, and arrange stored elements according to time
-void modify_channel(struct channel *chnl, int t, int newdelay, double newpe)
-{
-    if (newdelay != chnl->delay) {
-        void **newqueue = calloc(newdelay+1, sizeof(void *));
-        int newqueue_len = newdelay + 1;
-        int olddelay = chnl->delay;
-        int oldqueue_len = chnl->delay + 1;
-        if (newdelay < olddelay) {
-            for (int i=0; i<=newdelay; i++) {
-                int newpos = (t - i + newdelay) % newqueue_len;
-                int oldpos = (t - i + olddelay) % oldqueue_len;
-                newqueue[newpos] = chnl->queue[oldpos]; 
-            }
-        } else {
-            for (int i=0; i<=olddelay; i++) {
-                int newpos = (t - i + newdelay) % newqueue_len;
-                int oldpos = (t - i + olddelay) % oldqueue_len;
-                newqueue[newpos] = chnl->queue[oldpos]; 
-            }
-
+// The bucket holds the tokens of a slot plus those of a packet less one, i.e., it bursts at most the
+// packets of a slot rounded up to a whole number. The fraction of a packet left after a slot is
+// never lost to the cap, so a busy link of a fractional rate keeps up its rate.
+int set_channel_rate(struct channel *chnl, double rate, int qcap)
+{
+    static char fname[] = "set_channel_rate";
+    // a rate below half a token per slot rounds to zero and would never refill the bucket
+    if (!(rate * RATE_ONE + 0.5 >= 1) || rate * RATE_ONE > INT32_MAX || qcap < 0) {
+        fprintf(stderr, "%s: invalid rate %g or queue size %d\n", fname, rate, qcap);
+        return -1;
+    }
+    if (qcap != chnl->qcap) {
+        void **fifo = NULL;
+        if (qcap > 0 && (fifo = calloc(qcap, sizeof(void *))) == NULL) {
+            fprintf(stderr, "%s: calloc queue failed\n", fname);
+            return -1;
         }
-        void **tmp = chnl->queue;
-        chnl->queue = newqueue;
-        chnl->delay = newdelay;
-        free(tmp);
+        // packets beyond the new queue are dropped from its tail
+        int n = 0;
+        void *packet;
+        while ((packet = dequeue_from_channel(chnl)) != NULL) {
+            if (n < qcap)
+                fifo[n++] = packet;
+            else
+                chnl->release(packet);
+        }
+        free(chnl->fifo);
+        chnl->fifo  = fifo;
+        chnl->qcap  = qcap;
+        chnl->qhead = 0;
+        chnl->qsize = n;
+    }
+    chnl->rate  = (int64_t) (rate * RATE_ONE + 0.5);
+    chnl->depth = chnl->rate + RATE_ONE - 1;
+    if (chnl->tokens > chnl->depth)
+        chnl->tokens = chnl->depth;
+    return 0;
+}
+
+int channel_credit(struct channel *chnl, int t)
+{
+    if (t > chnl->tfill) {
+        int64_t tokens = chnl->tokens + chnl->rate * (t - chnl->tfill);
+        chnl->tokens = tokens < chnl->depth ? tokens : chnl->depth;
+        chnl->tfill = t;
     }
+    return (int) (chnl->tokens / RATE_ONE);
+}
+
+int channel_credit_time(struct channel *chnl, int t)
+{
+    if (channel_credit(chnl, t) > 0)
+        return t;
+    // the bucket has no whole packet of tokens at t
+    int64_t lack = RATE_ONE - chnl->tokens;
+    return t + (int) ((lack + chnl->rate - 1) / chnl->rate);
+}
+
+void spend_channel_credit(struct channel *chnl)
+{
+    chnl->tokens -= RATE_ONE;
+}
+
+int enqueue_to_channel(struct channel *chnl, void *packet)
+{
+    if (chnl->qsize == chnl->qcap)
+        return 1;
+    chnl->fifo[(chnl->qhead + chnl->qsize) % chnl->qcap] = packet;
+    chnl->qsize += 1;
+    return 0;
+}
+
+void *dequeue_from_channel(struct channel *chnl)
+{
+    if (chnl->qsize == 0)
+        return NULL;
+    void *packet = chnl->fifo[chnl->qhead];
+    chnl->fifo[chnl->qhead] = NULL;
+    chnl->qhead = (chnl->qhead + 1) % chnl->qcap;
+    chnl->qsize -= 1;
+    return packet;
+}
+
+// Modify channel characteristics. The delay line is never reallocated, so a delay beyond it is
+// rejected.
+void modify_channel(struct channel *chnl, int newdelay, double newpe)
+{
+    static char fname[] = "modify_channel";
+    if (chnl->trace != NULL)
+        return;     // the trace tells the channel characteristics
+    if (newdelay < 0 || newdelay >= chnl->ringlen)
+        fprintf(stderr, "%s: delay %d doesn't fit the delay line of %d slots, %d is kept\n", fname, newdelay, chnl->ringlen, chnl->delay);
+    else
+        chnl->delay = newdelay;
+    if (newpe != chnl->pe)
+        chnl->sampled = 0;      // slots not sent yet are resampled with the new pe
     chnl->pe = newpe;
-}
\ No newline at end of file
+}
+
+// Whether the next packet sent to the channel is erased
+static int erased(struct channel *chnl)
+{
+    int slot = chnl->ctr % ERASURE_SLOTS;
+    if (slot == 0 || !chnl->sampled) {
+        sample_erasures(chnl, chnl->ctr - slot, ERASURE_SLOTS, chnl->erasure);
+        chnl->sampled = 1;
+    }
+    chnl->ctr += 1;
+    return (chnl->erasure[slot/64] >> (slot%64)) & 1;
+}
+
+// Put a packet sent at time t into the delay line. It arrives in delay slots, or in the first later
+// slot not taken by another packet. Return 1 if there is no room, which should be rare, as the delay
+// line is sized for the largest delay of the channel.
+static int place_packet(struct channel *chnl, void *packet, int t, int delay)
+{
+    if (delay < 0)
+        delay = 0;
+    int mask = chnl->ringlen - 1;
+    for (int a=t+delay; a<t+chnl->ringlen; a++) {
+        struct inflight *e = &chnl->ring[a & mask];
+        if (e->packet != NULL && e->arrival < t) {
+            // it was never received at its arrival time
+            chnl->release(e->packet);
+            e->packet = NULL;
+        }
+        if (e->packet == NULL) {
+            e->packet  = packet;
+            e->arrival = a;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Make sure the delay line is longer than delay. It's only called as the channel is set up, i.e.,
+// created or given a trace, and the packets in flight are moved by their arrival time.
+static int reserve_ring(struct channel *chnl, int delay)
+{
+    if (delay < chnl->ringlen)
+        return 0;
+    int len = chnl->ringlen > 0 ? chnl->ringlen : RING_MIN;
+    while (len <= delay)
+        len *= 2;
+    struct inflight *ring = calloc(len, sizeof(struct inflight));
+    if (ring == NULL) {
+        fprintf(stderr, "reserve_ring: calloc delay line failed\n");
+        return -1;
+    }
+    for (int i=0; i<chnl->ringlen; i++) {
+        if (chnl->ring[i].packet != NULL)
+            ring[chnl->ring[i].arrival & (len-1)] = chnl->ring[i];
+    }
+    free(chnl->ring);
+    chnl->ring = ring;
+    chnl->ringlen = len;
+    return 0;
+}
+
+// Counter-based RNG: 32-bit finalizer of MurmurHash3 over the key and the counter
+static inline uint32_t stream_hash(uint32_t key, uint32_t ctr)
+{
+    uint32_t h = ctr * 0x9e3779b9u + key;
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+void sample_erasures(struct channel *chnl, uint32_t ctr, int n, uint64_t *bitmap)
+{
+    if (chnl->model != NULL) {
+        sample_markov(chnl, ctr, n, bitmap);
+        return;
+    }
+    // packet i is erased if its 32-bit random number is below pe * 2^32
+    if (chnl->pe >= 1.0) {
+        for (int w=0; w<n/64; w++)
+            bitmap[w] = ~(uint64_t) 0;
+        return;
+    }
+    uint32_t thresh = chnl->pe > 0 ? (uint32_t) (chnl->pe * 4294967296.0) : 0;
+    for (int w=0; w<n/64; w++) {
+        uint64_t bits = 0;
+        int i = 0;
+#if defined(INTEL_AVX2)
+        // unsigned compare by flipping the sign bits
+        const __m256i sign = _mm256_set1_epi32((int) 0x80000000u);
+        const __m256i thr  = _mm256_xor_si256(_mm256_set1_epi32((int) thresh), sign);
+        const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+        const __m256i key  = _mm256_set1_epi32((int) chnl->key);
+        for (; i<64; i+=8) {
+            __m256i c = _mm256_add_epi32(_mm256_set1_epi32((int) (ctr + w*64 + i)), lane);
+            __m256i h = _mm256_add_epi32(_mm256_mullo_epi32(c, _mm256_set1_epi32((int) 0x9e3779b9u)), key);
+            h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 16));
+            h = _mm256_mullo_epi32(h, _mm256_set1_epi32((int) 0x85ebca6bu));
+            h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 13));
+            h = _mm256_mullo_epi32(h, _mm256_set1_epi32((int) 0xc2b2ae35u));
+            h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 16));
+            __m256i lt = _mm256_cmpgt_epi32(thr, _mm256_xor_si256(h, sign));
+            bits |= (uint64_t) _mm256_movemask_ps(_mm256_castsi256_ps(lt)) << i;
+        }
+#endif
+        for (; i<64; i++)
+            bits |= (uint64_t) (stream_hash(chnl->key, ctr + w*64 + i) < thresh) << i;
+        bitmap[w] = bits;
+    }
+}
+
+// Random numbers of n consecutive counters
+static void hash_block(uint32_t key, uint32_t ctr, int n, uint32_t *out)
+{
+    int i = 0;
+#if defined(INTEL_AVX2)
+    const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i k    = _mm256_set1_epi32((int) key);
+    for (; i+8<=n; i+=8) {
+        __m256i c = _mm256_add_epi32(_mm256_set1_epi32((int) (ctr + i)), lane);
+        __m256i h = _mm256_add_epi32(_mm256_mullo_epi32(c, _mm256_set1_epi32((int) 0x9e3779b9u)), k);
+        h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 16));
+        h = _mm256_mullo_epi32(h, _mm256_set1_epi32((int) 0x85ebca6bu));
+        h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 13));
+        h = _mm256_mullo_epi32(h, _mm256_set1_epi32((int) 0xc2b2ae35u));
+        h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 16));
+        _mm256_storeu_si256((__m256i *) &out[i], h);
+    }
+#endif
+    for (; i<n; i++)
+        out[i] = stream_hash(key, ctr + i);
+}
+
+// Walk the Markov chain through the slots. The random numbers are generated in bulk from three
+// streams of the channel: erasures, alias columns and alias acceptance.
+static void sample_markov(struct channel *chnl, uint32_t ctr, int n, uint64_t *bitmap)
+{
+    struct loss_model *m = chnl->model;
+    if (ctr != chnl->mblock) {
+        chnl->mstate = chnl->mnext;
+        chnl->mblock = ctr;
+    }
+    int state = chnl->mstate;
+    uint32_t u[3][64];
+    uint32_t k1 = stream_hash(chnl->key, 1), k2 = stream_hash(chnl->key, 2);
+    for (int w=0; w<n/64; w++) {
+        hash_block(chnl->key, ctr + w*64, 64, u[0]);
+        hash_block(k1, ctr + w*64, 64, u[1]);
+        hash_block(k2, ctr + w*64, 64, u[2]);
+        uint64_t bits = 0;
+        for (int i=0; i<64; i++) {
+            bits |= (uint64_t) (u[0][i] < m->pe[state]) << i;
+            int col = (int) (((uint64_t) u[1][i] * m->nstate) >> 32);
+            int e = state * m->nstate + col;
+            state = u[2][i] < m->prob[e] ? col : m->alias[e];
+        }
+        bitmap[w] = bits;
+    }
+    chnl->mnext = state;
+}
+
+static uint64_t threshold(double p)
+{
+    if (p <= 0)
+        return 0;
+    if (p >= 1)
+        return (uint64_t) 1 << 32;
+    return (uint64_t) (p * 4294967296.0);
+}
+
+struct loss_model *create_markov_model(int nstate, const double *trans, const double *pe)
+{
+    static char fname[] = "create_markov_model";
+    struct loss_model *m = calloc(1, sizeof(struct loss_model));
+    if (m == NULL)
+        goto AllocError;
+    m->nstate = nstate;
+    m->pe    = malloc(nstate * sizeof(uint64_t));
+    m->prob  = malloc(nstate * nstate * sizeof(uint64_t));
+    m->alias = malloc(nstate * nstate * sizeof(int));
+    double *q  = malloc(nstate * sizeof(double));
+    int *small = malloc(nstate * sizeof(int));
+    int *large = malloc(nstate * sizeof(int));
+    if (m->pe == NULL || m->prob == NULL || m->alias == NULL || q == NULL || small == NULL || large == NULL) {
+        free(q);
+        free(small);
+        free(large);
+        goto AllocError;
+    }
+    for (int s=0; s<nstate; s++) {
+        m->pe[s] = threshold(pe[s]);
+        // Vose's alias method over row s of the transition matrix
+        double sum = 0;
+        for (int j=0; j<nstate; j++)
+            sum += trans[s*nstate+j];
+        int ns = 0, nl = 0;
+        for (int j=0; j<nstate; j++) {
+            q[j] = sum > 0 ? trans[s*nstate+j] * nstate / sum : (j == s ? nstate : 0);
+            if (q[j] < 1)
+                small[ns++] = j;
+            else
+                large[nl++] = j;
+        }
+        while (ns > 0 && nl > 0) {
+            int l = small[--ns];
+            int g = large[--nl];
+            m->prob[s*nstate+l]  = threshold(q[l]);
+            m->alias[s*nstate+l] = g;
+            q[g] -= 1 - q[l];
+            if (q[g] < 1)
+                small[ns++] = g;
+            else
+                large[nl++] = g;
+        }
+        while (nl > 0) {
+            int g = large[--nl];
+            m->prob[s*nstate+g]  = threshold(1);
+            m->alias[s*nstate+g] = g;
+        }
+        while (ns > 0) {
+            int l = small[--ns];        // only left by rounding errors
+            m->prob[s*nstate+l]  = threshold(1);
+            m->alias[s*nstate+l] = l;
+        }
+    }
+    free(q);
+    free(small);
+    free(large);
+    return m;
+
+AllocError:
+    fprintf(stderr, "%s: malloc loss model failed\n", fname);
+    free_loss_model(m);
+    return NULL;
+}
+
+// Gilbert-Elliott model, where state 0 is the good state and state 1 the bad state. p_gb and p_bg
+// are the probabilities of moving from good to bad and from bad to good.
+struct loss_model *create_gilbert_elliott_model(double p_gb, double p_bg, double pe_good, double pe_bad)
+{
+    double trans[4] = {1-p_gb, p_gb, p_bg, 1-p_bg};
+    double pe[2] = {pe_good, pe_bad};
+    return create_markov_model(2, trans, pe);
+}
+
+void free_loss_model(struct loss_model *model)
+{
+    if (model == NULL)
+        return;
+    free(model->pe);
+    free(model->prob);
+    free(model->alias);
+    free(model);
+}
+
+void set_loss_model(struct channel *chnl, struct loss_model *model)
+{
+    free_loss_model(chnl->model);
+    chnl->model  = model;
+    chnl->mstate = chnl->mnext = 0;
+    chnl->mblock = chnl->ctr - chnl->ctr % ERASURE_SLOTS;
+    chnl->sampled = 0;
+}
+
+// Parse n comma separated numbers, return the position after them or NULL on error
+static const char *parse_numbers(const char *s, int n, double *v)
+{
+    for (int i=0; i<n; i++) {
+        char *end;
+        v[i] = strtod(s, &end);
+        if (end == s || (i < n-1 && *end != ','))
+            return NULL;
+        s = i < n-1 ? end + 1 : end;
+    }
+    return s;
+}
+
+void set_channel_from_env(struct channel *chnl)
+{
+    static char fname[] = "set_channel_from_env";
+    static struct channel_trace *trace = NULL;     // opened once, for all channels
+    char *tr = getenv("CHANNEL_TRACE");
+    char *ge = getenv("GILBERT_ELLIOTT");
+    char *mk = getenv("MARKOV_LOSS");
+    if (tr != NULL) {
+        if (trace == NULL && (trace = open_channel_trace(tr)) == NULL)
+            return;
+        set_channel_trace(chnl, trace, -1, 1);
+    } else if (ge != NULL) {
+        double v[4];
+        if (parse_numbers(ge, 4, v) == NULL) {
+            fprintf(stderr, "%s: GILBERT_ELLIOTT should be p_gb,p_bg,pe_good,pe_bad\n", fname);
+            return;
+        }
+        set_loss_model(chnl, create_gilbert_elliott_model(v[0], v[1], v[2], v[3]));
+    } else if (mk != NULL) {
+        char *end;
+        int k = (int) strtol(mk, &end, 10);
+        double *v = k > 0 ? malloc((k*k + k) * sizeof(double)) : NULL;
+        const char *s = *end == ':' ? end + 1 : NULL;
+        if (v != NULL && s != NULL)
+            s = parse_numbers(s, k*k, v);
+        if (s != NULL && *s == ':')
+            s = parse_numbers(s+1, k, v + k*k);
+        else
+            s = NULL;
+        if (v == NULL || s == NULL) {
+            fprintf(stderr, "%s: MARKOV_LOSS should be K:transition matrix:erasure probabilities\n", fname);
+            free(v);
+            return;
+        }
+        set_loss_model(chnl, create_markov_model(k, v, v + k*k));
+        free(v);
+    }
+}
+
+// Map a trace file into memory
+struct channel_trace *open_channel_trace(const char *path)
+{
+    static char fname[] = "open_channel_trace";
+    struct channel_trace *trace = NULL;
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(struct trace_header)) {
+        fprintf(stderr, "%s: cannot open trace %s\n", fname, path);
+        goto Error;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "%s: mmap trace %s failed\n", fname, path);
+        goto Error;
+    }
+    const struct trace_header *hdr = map;
+    if (memcmp(hdr->magic, TRACE_MAGIC, 4) != 0 || hdr->version != TRACE_VERSION || hdr->nslot == 0
+            || (size_t) st.st_size < sizeof(struct trace_header) + hdr->nslot * sizeof(uint16_t)) {
+        fprintf(stderr, "%s: %s is not a valid trace\n", fname, path);
+        munmap(map, st.st_size);
+        goto Error;
+    }
+    if ((trace = malloc(sizeof(struct channel_trace))) == NULL) {
+        munmap(map, st.st_size);
+        goto Error;
+    }
+    trace->slot     = (const uint16_t *) ((const char *) map + sizeof(struct trace_header));
+    trace->nslot    = hdr->nslot;
+    trace->maxdelay = hdr->maxdelay;
+    trace->map      = map;
+    trace->maplen   = st.st_size;
+Error:
+    if (fd >= 0)
+        close(fd);
+    return trace;
+}
+
+void close_channel_trace(struct channel_trace *trace)
+{
+    if (trace == NULL)
+        return;
+    munmap(trace->map, trace->maplen);
+    free(trace);
+}
+
+// The delay line is lengthened to hold packets of the largest delay of the trace, with a margin
+// for packets which find their arrival slot taken.
+void set_channel_trace(struct channel *chnl, struct channel_trace *trace, int64_t offset, int loop)
+{
+    if (reserve_ring(chnl, trace->maxdelay + RING_MIN) < 0)
+        return;
+    chnl->trace = trace;
+    chnl->tloop = loop;
+    chnl->tstart = offset;
+    if (offset < 0) {
+        uint64_t r = (uint64_t) stream_hash(chnl->key, 3) << 32 | stream_hash(chnl->key, 4);
+        offset = r % trace->nslot;
+    }
+    chnl->toff = (uint64_t) offset % trace->nslot;
+}
+
+// Delay of the next packet given by the trace, or -1 if it's lost
+static int trace_delay(struct channel *chnl)
+{
+    uint64_t rec = chnl->toff + chnl->ctr;
+    chnl->ctr += 1;
+    if (rec >= chnl->trace->nslot) {
+        if (!chnl->tloop)
+            return -1;
+        rec %= chnl->trace->nslot;
+    }
+    uint16_t r = chnl->trace->slot[rec];
+    if (r & TRACE_LOST)
+        return -1;
+    return r & TRACE_DELAY;
+}
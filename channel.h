@@ -1,24 +1,153 @@
+#ifndef CHANNEL_H
+#define CHANNEL_H
 #include <stdio.h>
+#include <stdint.h>
 
 /*
  * Channel with delay and erasure
- * Implemented using an array to simulate a delayed queue
+ * Implemented using a delay line, which is a ring of packets indexed by their arrival time
  */
 
+#define ERASURE_SLOTS 256   // number of slots whose erasures are sampled at a time
+
+// Markov loss model. The channel is in one of nstate states, where a packet is erased with the
+// probability of the state, and moves to the next state by the transition matrix after each
+// packet. The Gilbert-Elliott model is the two-state case. Transitions are sampled by the alias
+// method, so each packet takes O(1) time regardless of nstate.
+struct loss_model {
+    int         nstate;
+    uint64_t    *pe;        // erasure threshold of each state, pe * 2^32
+    uint64_t    *prob;      // alias method, nstate x nstate acceptance thresholds of 2^32
+    int         *alias;     // nstate x nstate alias states
+};
+
+// Binary trace of a link, made by trace-convert from a CSV capture. The header is followed by one
+// 16-bit record per slot, where the top bit tells whether the packet sent in the slot is lost
+// and the other bits give its delay in slots.
+#define TRACE_MAGIC     "BTRC"
+#define TRACE_VERSION   1
+#define TRACE_LOST      0x8000
+#define TRACE_DELAY     0x7fff
+struct trace_header {
+    char        magic[4];
+    uint32_t    version;
+    uint32_t    maxdelay;   // largest delay of the records
+    uint32_t    reserved;
+    uint64_t    nslot;      // number of records
+};
+
+// A trace mapped into memory, which is shared by all channels replaying it
+struct channel_trace {
+    const uint16_t  *slot;
+    uint64_t        nslot;
+    int             maxdelay;
+    void            *map;
+    size_t          maplen;
+};
+
+// Packet in the delay line, which arrives at time arrival
+struct inflight {
+    void    *packet;
+    int     arrival;
+};
+
+#define RING_MIN    64      // minimum length of the delay line
+#define RATE_ONE    65536   // tokens of a packet, rates of links are in fixed point
+
 typedef struct channel {
-    void    **queue;
+    struct inflight *ring;  // delay line, packet arriving at time t is at ring[t % ringlen]
+    int     ringlen;        // power of two larger than the delays of the channel
     int     delay;
     double  pe;
+    void    (*release)(void *packet);   // frees packets the channel drops, free() by default
+    // Erasures are drawn from a counter-based RNG stream of the channel, so the erasure of
+    // the n-th packet sent only depends on the key and n.
+    uint32_t key;           // key of the RNG stream
+    uint32_t ctr;           // number of packets sent so far
+    uint64_t erasure[ERASURE_SLOTS/64];  // erasure bits of the slots from ctr - ctr%ERASURE_SLOTS
+    int     sampled;        // whether erasure bits are valid
+    struct loss_model *model;   // loss model, or NULL if erasures are i.i.d. with probability pe
+    int     mstate;         // Markov state at the first slot of mblock
+    int     mnext;          // Markov state after the last sampled slot
+    uint32_t mblock;        // first slot of the sampled erasure bits
+    struct channel_trace *trace;    // trace to replay, which overrides delay, pe and model
+    uint64_t toff;          // record of the trace for the first packet sent
+    int64_t tstart;         // offset given to set_channel_trace()
+    int     tloop;          // whether to loop over the trace, else packets beyond it are lost
+    // The link sends packets into the channel at a limited rate, given by a token bucket. Packets
+    // which cannot be sent yet wait in a drop-tail queue.
+    int64_t rate;           // tokens per slot
+    int64_t depth;          // size of the token bucket, i.e., the largest burst
+    int64_t tokens;         // tokens in the bucket at time tfill
+    int     tfill;
+    void    **fifo;         // queue of the link, packets are in fifo[qhead ... qhead+qsize-1]
+    int     qcap;
+    int     qhead;
+    int     qsize;
 } Channel;
 
-struct channel *create_channel(int delay, double pe);
+// The delay line is sized once for delays up to maxdelay, or delay if it's larger.
+struct channel *create_channel(int delay, int maxdelay, double pe);
+struct channel *create_channel_seeded(int delay, int maxdelay, double pe, uint32_t seed);
 void free_channel(struct channel *chnl);
+// Restore the channel as just created, with an RNG stream of a new key, for another episode
+void reset_channel(struct channel *chnl);
+void reset_channel_seeded(struct channel *chnl, uint32_t seed);
+void set_channel_release(struct channel *chnl, void (*release)(void *packet));
+// Send a packet at time t, and return whether it's erased. An erased packet is still owned by the
+// caller, while the others are owned by the channel until they are received.
 int send_to_channel(struct channel *chnl, void *packet, int t);
+// Send with a delay of the packet's own, e.g. for jittered links. Packets may be reordered.
+int send_to_channel_delayed(struct channel *chnl, void *packet, int t, int delay);
+// Decide the fate of the next packet sent to the channel without queueing it, for simulators which
+// keep packets in flight by themselves. Return the delay of the packet, or -1 if it's erased.
+int channel_transit(struct channel *chnl);
+// Limit the link to rate packets per slot on average, with a queue of qcap packets. It sends one
+// packet per slot without queue by default.
+int set_channel_rate(struct channel *chnl, double rate, int qcap);
+// Number of packets the link can send at time t
+int channel_credit(struct channel *chnl, int t);
+// Earliest time no earlier than t when the link can send a packet
+int channel_credit_time(struct channel *chnl, int t);
+// Take the tokens of a packet sent at the current time, see channel_credit()
+void spend_channel_credit(struct channel *chnl);
+// Append a packet to the queue of the link, return 1 if it's dropped as the queue is full
+int enqueue_to_channel(struct channel *chnl, void *packet);
+// Take the packet at the head of the queue of the link, or NULL if the queue is empty
+void *dequeue_from_channel(struct channel *chnl);
+// Receive the packet arriving at time t, if any. Packets which are not received at their arrival
+// time are released by the channel.
 void *recv_from_channel(struct channel *chnl, int t);
 
-// The inflight packets of the channel is implemented as an array of pointers (queue) of length equal
-// to delay+1. If the new delay is smaller than the old, the queue would be shrinked. The caller of the
-// channel has to ensure that recv_from_channle() is called for (olddelay-newdelay) times to receive the
-// packets in the shrinked part of the old queue.
-void modify_channel(struct channel *chnl, int t, int delay, double pe);
+// Sample the erasures of n packets, starting from the ctr-th packet sent to the channel, into a
+// bitmap. Bit i is set if packet ctr+i is erased. n must be a multiple of 64. With a Markov loss
+// model, the state is carried over, so ctr is either the last ctr or the last ctr plus n.
+void sample_erasures(struct channel *chnl, uint32_t ctr, int n, uint64_t *bitmap);
+
+// Loss models. trans is the nstate x nstate row-major transition matrix and pe the erasure
+// probabilities of the states. The channel takes over the model, starting from state 0.
+// modify_channel() changes pe of i.i.d. erasures only.
+struct loss_model *create_markov_model(int nstate, const double *trans, const double *pe);
+struct loss_model *create_gilbert_elliott_model(double p_gb, double p_bg, double pe_good, double pe_bad);
+void free_loss_model(struct loss_model *model);
+void set_loss_model(struct channel *chnl, struct loss_model *model);
+
+// Trace replay. The trace is mapped read-only, so it's shared by the processes replaying it.
+// The channel replays the trace from record offset, or from a random record of the channel's
+// RNG stream if offset is negative. A packet sent with delay d arrives in d slots, or in the
+// first later slot not taken by another packet.
+struct channel_trace *open_channel_trace(const char *path);
+void close_channel_trace(struct channel_trace *trace);
+void set_channel_trace(struct channel *chnl, struct channel_trace *trace, int64_t offset, int loop);
+
+// Set the loss model or trace given by environment variables, if any
+//   GILBERT_ELLIOTT="p_gb,p_bg,pe_good,pe_bad"
+//   MARKOV_LOSS="K:t_00,...,t_0(K-1),...,t_(K-1)(K-1):pe_0,...,pe_(K-1)"
+//   CHANNEL_TRACE="path", replayed in loop from a random offset
+void set_channel_from_env(struct channel *chnl);
 
+// Change the delay and erasure probability of packets sent from now on. Packets in flight keep their
+// arrival time, so they may be overtaken by later packets if the delay is reduced. The delay must
+// fit the delay line sized as the channel was created.
+void modify_channel(struct channel *chnl, int delay, double pe);
+#endif
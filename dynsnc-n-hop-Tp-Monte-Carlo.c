@@ -6,17 +6,11 @@
 #include <unistd.h>
 #include <fcntl.h>
 
-#include "bats.h"
-#include "channel.h"
+#include "engine.h"
 
-int currbatch = 0;
-// encoder
-int batchsent = 0;              // number of packets sent from the current batch
-// recoder
-int s_count = 0;    // number of recoded packets sent from the current batc
-// decoder
-int batchcount = 0;   // number of received packets of the current receiving batch
-int dofcount = 0;     // number of innovative packets contributed by the current receiving batch
+// counters of the current batch, see engine.c
+extern int currbatch;
+extern int batchsent;
 
 double alpha;
 double beta;
@@ -36,7 +30,29 @@ int    action[3][2] = {
 
 double pe;
 
+// State of Monte Carlo control in an episode
+struct montecarlo {
+    // arrays to store information for processing after each episode
+    int     *state_seq;
+    int     *action_seq;
+    int     *reward_seq;
+    int     act_seq;
+    int     r_curr;         // DoF of the decoder known when the current batch started
+    int     act_id;         // action of the current batch
+};
+
+// Channels of the hops if NONSTATIONARY is set
+struct nonstationary {
+    int     nslots;
+    int     Tp;
+    double  *pe;
+};
+
 static int derive_action_id_from_policy(int r);
+static void first_batch(void *ctx, struct snc_engine *eng, int *deg, int *bts);
+static void next_batch(void *ctx, struct snc_engine *eng, int *deg, int *bts);
+static void episode_done(void *ctx, struct snc_engine *eng);
+static void change_channels(void *arg, struct snc_engine *eng);
 
 char usage[] = "Simulate n-hop lossy line networks\n\
                 \n\
@@ -61,7 +77,7 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
-    int i, j;
+    int i;
     // Q-learning parameters
     int nslots = atoi(argv[1]);
     alpha = atof(argv[2]);
@@ -76,12 +92,17 @@ int main(int argc, char *argv[])
     int Tp   = atoi(argv[10]);
     double lambda = atof(argv[11]);
     int bufsize = snum+cnum;
-    int pktsize = 256;
+    // Only ranks are simulated if RANK_ONLY is set, where packets carry no payload
+    int pktsize = getenv("RANK_ONLY") != NULL ? 0 : 256;
+    // Number of HDPC packets of the precode, given by HDPC
+    int hnum = getenv("HDPC") != NULL ? atoi(getenv("HDPC")) : 0;
+    // Decoder of the destination, given by BATS_DECODER="ref", "bp" or "inac"
+    int dectype = snc_decoder_from_env();
     int datasize = snum * pktsize;
     
     // Initialize Q table
     // Allocate memory, and then try to load existing Q-table and learn based on it
-    int K = snum + cnum;
+    int K = snum + cnum + hnum;
     //nstate = (K + 1) * (K + 2) / 2;
     nstate = K + 1;
     Qtable = calloc(nstate, sizeof(double*));
@@ -116,269 +137,149 @@ int main(int argc, char *argv[])
     int rnd=open("/dev/urandom", O_RDONLY);
     read(rnd, databuf, datasize);
     close(rnd);
-    int t = 0;
-    int episode = 0;
-    int newgen = 1;         // indicate a generation of transmissions
-    while (t < nslots) {
-        if (newgen) {
-            episode += 1;
-            printf("Learning from episode %d...\n", episode);
-            newgen = 0;
-            //epsilon = epsilon * 0.99;
-        }
-
-        BATSparam param = { datasize,
-                            0,              // no need to specify number of source packets
-                            cnum,           // parity-check packets
-                            pktsize,
-                            0,              // seed for RNG
-                        };
-        // create encoder at source node
-        BATSencoder *encoder = bats_create_encoder(databuf, &param);
-        // create recoders at intermediate nodes
-        BATSbuffer **buf = calloc(nhop-1, sizeof(BATSbuffer*));
-        for (i=0; i<nhop-1; i++)
-            buf[i] = bats_create_buffer(&param, bufsize);
-        // create decoder at destination node
-        struct bats_decoder_ref *decoder = bats_create_decoder_ref(&param);
-
-
-        // create channels
-        struct channel **chnl = calloc(nhop, sizeof(struct chnl*));
-        double fb_succ = 1.0;
-        for (i=0; i<nhop; i++) {
-            chnl[i] = create_channel(Tp, pe);
-            fb_succ *= (1-pe);
-        }
-        // create feedback channel (note multihop relay) 
-        struct channel *fdbk_chnl;
-        char *perfect_fb = getenv("PERFECT_FB");
-        if (perfect_fb != NULL && strcmp(perfect_fb, "TRUE") == 0) {
-            fdbk_chnl = create_channel(0, 0);
-        } else {
-            fdbk_chnl = create_channel(Tp*nhop, 1-fb_succ);
-        }
-        
-        // arrays to store information for processing after each episode
-        int *state_seq = calloc(10000, sizeof(int));
-        int *action_seq = calloc(10000, sizeof(int));
-        int *reward_seq = calloc(10000, sizeof(int));
-        int act_seq = 0;
-
-        BATSpacket *pkt;
-        int nuse = 0;                   // number of network uses
-        int r_curr = 0;
-        int r_next = 0;
-        //int act_id = derive_e_greedy_action(r_curr, Qtable, naction);
-        int act_id = derive_action_id_from_policy(r_curr);  // derive from the e-soft policy
-        int newDeg = action[act_id][0];
-        int newBts = action[act_id][1];
-        // create new batch
-        printf("Current (r, c) = ( %d %d ). Action: deg= %d bts= %d\n", 0, 0, newDeg, newBts);
-        bats_start_new_batch(encoder, currbatch, newDeg, newBts);
-
-        while (!decoder->finished) {
-            // change channel paramter if an environment argument is set
-            if (t== nslots/3 || t == 2 * nslots/3) {
-                char *changing = getenv("NONSTATIONARY");
-                if (changing != NULL && strcmp(changing, "TRUE") == 0) {
-                    if (t == nslots/3) {
-                            pe = pe * 2;
-                            Tp = Tp * 2;
-                    }
-                    if (t == 2 * nslots /3) {
-                            pe = pe / 4;
-                            Tp = Tp / 4;
-                    }
-                    // modify channel parameters
-                    printf("At time %d, channel paramters are changed\n", t);
-                    fb_succ = 1.0;
-                    for (i=0; i<nhop; i++) {
-                        modify_channel(chnl[i], t, Tp, pe);
-                        fb_succ *= (1-pe);
-                    }
-                    char *perfect_fb = getenv("PERFECT_FB");
-                    if (perfect_fb != NULL && strcmp(perfect_fb, "TRUE") == 0) {
-                        modify_channel(fdbk_chnl, t, 0, 0);
-                    } else {
-                        modify_channel(fdbk_chnl, t, Tp *2, 1-fb_succ);
-                    }
-                }
-            }
-            // use each forward hop once
-            for (int i=0; i<nhop; i++) {
-                // first hop
-                if (i == 0) {
-                    pkt = bats_encode_packet(encoder);
-                } else {
-                    pkt = bats_recode_packet(buf[i-1]);
-                    if (pkt == NULL) {
-                        continue;
-                    }
-                }
-                // send to channel of hop i
-                int lost = send_to_channel(chnl[i], pkt, nuse);
-                if (lost) {
-                    bats_free_packet(pkt);
-                    pkt = NULL;
-                    printf("Packet sent on hop %d at time %d is lost\n", i, nuse);
-                }
-                // receive from channel of hop i
-                BATSpacket *rpkt = (BATSpacket*) recv_from_channel(chnl[i], nuse);
-                if (rpkt != NULL) {
-                    if (i < nhop-1) {
-                        bats_buffer_packet(buf[i], rpkt);        // next node is an intermediate node
-                    } else {
-                        bats_process_packet_ref(decoder, rpkt);  // next node is decoder
-                    }
-                } else {
-                    printf("Receive NULL from channel of hop %d at time %d\n", i, nuse);
-                }
-            }
-            // decoder feedback to sender its currently received DoF
-            int *r_feedback = calloc(1, sizeof(int));
-            r_feedback[0] = decoder->DoF;
-            printf("Decoder send feedback r = %d at time %d\n", decoder->DoF, nuse);
-            int fblost = send_to_channel(fdbk_chnl, r_feedback, nuse);
-            if (fblost) {
-                free(r_feedback);
-                r_feedback= NULL;
-            }
-            // sender receive r feedback
-            int *recv_r = (int *) recv_from_channel(fdbk_chnl, nuse);
-            if (recv_r != NULL) {
-                r_next = recv_r[0];         // update r knowledge at the sender
-                printf("Received feedback r = %d from decoder at time %d\n", r_next, nuse);
-                free(recv_r);
-                recv_r = NULL;
-            }
 
-            // check whether it's time to change a batch
-            if (batchsent >= encoder->currbat->bts || decoder->finished) {
-                // will start a new batch, summarize last batch statistics
-                // printf("Received %d packets from batch %d (BTS: %d) and %d are innovative [sent from buffer: %d]\n", batchcount, currbatch, encoder->currbat->bts, dofcount, s_count);
-                // printf("Batch %d is done, start next batch...\n", currbatch);
-                // get (r, c) feedback from decoder, i.e., the observed new state
-                int oldDeg = encoder->currbat->degree;
-                int oldBts = encoder->currbat->bts;
-                double reward = 0.0;
-                if (decoder->finished) {
-                    reward = - batchsent;
-                } else {
-                    reward = - oldBts;
-                }
-                // Record state, action, and reward sequence
-                state_seq[act_seq] = r_curr;
-                action_seq[act_seq] = act_id;
-                reward_seq[act_seq] = reward;
-                
-                printf(" r_prev= %d , batch %d action: deg= %d bts= %d r_new= %d , reward: %.4f next action: deg= %d bts=%d\n", 
-                         r_curr, currbatch, oldDeg, oldBts, r_next, reward, newDeg, newBts);
-                // choose NEW action following policy pi
-                r_curr = r_next;
-                act_id = derive_action_id_from_policy(r_curr);
-                newDeg = action[act_id][0];
-                newBts = action[act_id][1];
-                act_seq += 1;
+    // change_channels() doubles Tp at 1/3 of the slots
+    struct snc_config cfg = { snum, cnum, hnum, pktsize, bufsize, nhop, Tp, 2*Tp, pe, SNC_FEEDBACK, dectype };
+    // create feedback channel (note multihop relay) 
+    char *perfect_fb = getenv("PERFECT_FB");
+    if (perfect_fb != NULL && strcmp(perfect_fb, "TRUE") == 0)
+        cfg.feedback = SNC_PERFECT_FEEDBACK;
+    struct montecarlo mc = { NULL, NULL, NULL, 0, 0, 0 };
+    struct snc_policy policy = { &mc, first_batch, next_batch, episode_done };
+    struct snc_engine *eng = snc_create_engine(&cfg, databuf, &policy);
+    // change channel paramter if an environment argument is set
+    struct nonstationary ns = { nslots, Tp, calloc(nhop, sizeof(double)) };
+    char *changing = getenv("NONSTATIONARY");
+    if (changing != NULL && strcmp(changing, "TRUE") == 0) {
+        eng->on_slot = change_channels;
+        eng->on_slot_arg = &ns;
+    }
 
-                // Start next batch if the episode is not yet complete
-                if (!decoder->finished) {
-                    currbatch++;
-                    bats_start_new_batch(encoder, currbatch, newDeg, newBts);
-                }
-                // reset batchsent
-                batchsent = 0;
-                batchcount = 0;
-                dofcount = 0;
-                s_count = 0;
-            }
-            t++;
-            nuse++;
-            batchsent++;
-        }
-        for (int i=0; i<param.snum; i++) {
-            if (memcmp(encoder->pp[i], decoder->pp[i], param.pktsize) != 0) {
-                fprintf(stderr, "recovered is NOT identical to original.\n");
-                break;
-            }
-        }
+    while (eng->t < nslots) {
+        printf("Learning from episode %d...\n", eng->episode+1);
+        //epsilon = epsilon * 0.99;
+        if (snc_start_episode(eng) < 0)
+            break;
+        while (!snc_step(eng))
+            ;
 
         printf("bufsize: %d numhop: %d ", bufsize, nhop);
         printf("\n");
 
+        struct bats_decoder *decoder = &eng->decoder;
         printf("time: %d snum: %d cnum: %d pktsize: %d nbatch: %d overhead: %.4f ops: %.6f network-uses: %d ( episode: %d )\n", 
-               t, param.snum, param.cnum, param.pktsize, encoder->batnum, 
-               (double) decoder->overhead/decoder->param->snum, (double) decoder->operations/decoder->param->snum/decoder->param->pktsize, nuse, episode);
-
-        // process the previous episode, backward loop
-        double G = 0.0;
-        int s_prev = -1;
-        int a_prev = -1;
-        for (int i=act_seq-1; i--; i>=0) {
-            G = gamma * G + reward_seq[i];
-            int s = state_seq[i];
-            int a = action_seq[i];
-            if (s == s_prev && a == a_prev) {
-                continue;
-                // Note: since state of our problem is non-decreasing, we only need to compare with the previous
-                // state and action to ensure first-visit in the current episode.
-            }
-            Rtable[s][a] += G;
-            visits[s][a] += 1;
-            Qtable[s][a] = Rtable[s][a] / visits[s][a];
-            int opt_actid = derive_optimal_action(s, Qtable, naction);
-            for (int j=0; j<naction; j++) {
-                if (j == opt_actid) {
-                    piPolicy[s][j] = 1 - epsilon + epsilon / naction;
-                } else {
-                    piPolicy[s][j] = epsilon / naction;
-                }
-            }
-            s_prev = s;
-            a_prev = a;
-        }
-        free(state_seq);
-        free(reward_seq);
-        free(action_seq);
-        // free memory allocation
-        // free encoder
-        bats_free_encoder(encoder);
-        encoder = NULL;
-        // free recoder buffers
-        for (i=0; i<nhop-1;i++) {
-            if (buf[i] != NULL) {
-                bats_free_buffer(buf[i]);
-                buf[i] = NULL;
-            }
-        }
-        free(buf);
-        buf = NULL;
-        // free decoder
-        bats_free_decoder_ref(decoder);
-        decoder = NULL;
-        currbatch = 0;
-        // free channel
-        for (i=0; i<nhop; i++) {
-            free_channel(chnl[i]);
-            chnl[i] = NULL;
-        }
-        free_channel(fdbk_chnl);
-        fdbk_chnl = NULL;
-        // encoder
-        batchsent = 0;              // number of packets sent from the current batch
-        // recoder
-        s_count = 0;    // number of recoded packets sent from the current batc
-        // decoder
-        batchcount = 0;   // number of received packets of the current receiving batch
-        dofcount = 0;     // number of innovative packets contributed by the current receiving batch
-        newgen = 1;     // to start a new generation (i.e., episode)
+               eng->t, eng->param.snum, eng->param.cnum, eng->param.pktsize, eng->encoder->batnum, 
+               (double) decoder->ops->overhead(decoder->ctx)/eng->param.snum, (double) decoder->ops->operations(decoder->ctx)/eng->param.snum/(eng->param.pktsize != 0 ? eng->param.pktsize : 1), eng->nuse, eng->episode);
+        snc_end_episode(eng);
     }
     //save_table(Qfname, Qtable, nstate, naction);
     //save_table(vQfname, visits, nstate, naction);
+    snc_free_engine(eng);
+    free(ns.pe);
     free(databuf);
     return 0;
 }
 
+static void first_batch(void *ctx, struct snc_engine *eng, int *deg, int *bts)
+{
+    struct montecarlo *mc = ctx;
+    mc->state_seq = calloc(10000, sizeof(int));
+    mc->action_seq = calloc(10000, sizeof(int));
+    mc->reward_seq = calloc(10000, sizeof(int));
+    mc->act_seq = 0;
+    mc->r_curr = 0;
+    //mc->act_id = derive_e_greedy_action(mc->r_curr, Qtable, naction);
+    mc->act_id = derive_action_id_from_policy(mc->r_curr);  // derive from the e-soft policy
+    *deg = action[mc->act_id][0];
+    *bts = action[mc->act_id][1];
+    printf("Current (r, c) = ( %d %d ). Action: deg= %d bts= %d\n", 0, 0, *deg, *bts);
+}
+
+// The batch is done, record its reward and choose the action of the next batch following policy pi
+static void next_batch(void *ctx, struct snc_engine *eng, int *deg, int *bts)
+{
+    struct montecarlo *mc = ctx;
+    int r_next = eng->net->r_fb;   // r knowledge at the sender
+    int oldDeg = eng->encoder->currbat->degree;
+    int oldBts = eng->encoder->currbat->bts;
+    double reward = 0.0;
+    if (eng->decoder.ops->finished(eng->decoder.ctx)) {
+        reward = - batchsent;
+    } else {
+        reward = - oldBts;
+    }
+    // Record state, action, and reward sequence
+    mc->state_seq[mc->act_seq] = mc->r_curr;
+    mc->action_seq[mc->act_seq] = mc->act_id;
+    mc->reward_seq[mc->act_seq] = reward;
+    
+    printf(" r_prev= %d , batch %d action: deg= %d bts= %d r_new= %d , reward: %.4f next action: deg= %d bts=%d\n", 
+             mc->r_curr, currbatch, oldDeg, oldBts, r_next, reward, *deg, *bts);
+    // choose NEW action following policy pi
+    mc->r_curr = r_next;
+    mc->act_id = derive_action_id_from_policy(mc->r_curr);
+    *deg = action[mc->act_id][0];
+    *bts = action[mc->act_id][1];
+    mc->act_seq += 1;
+}
+
+static void episode_done(void *ctx, struct snc_engine *eng)
+{
+    struct montecarlo *mc = ctx;
+    // process the previous episode, backward loop
+    double G = 0.0;
+    int s_prev = -1;
+    int a_prev = -1;
+    for (int i=mc->act_seq-1; i--; i>=0) {
+        G = gamma * G + mc->reward_seq[i];
+        int s = mc->state_seq[i];
+        int a = mc->action_seq[i];
+        if (s == s_prev && a == a_prev) {
+            continue;
+            // Note: since state of our problem is non-decreasing, we only need to compare with the previous
+            // state and action to ensure first-visit in the current episode.
+        }
+        Rtable[s][a] += G;
+        visits[s][a] += 1;
+        Qtable[s][a] = Rtable[s][a] / visits[s][a];
+        int opt_actid = derive_optimal_action(s, Qtable, naction);
+        for (int j=0; j<naction; j++) {
+            if (j == opt_actid) {
+                piPolicy[s][j] = 1 - epsilon + epsilon / naction;
+            } else {
+                piPolicy[s][j] = epsilon / naction;
+            }
+        }
+        s_prev = s;
+        a_prev = a;
+    }
+    free(mc->state_seq);
+    free(mc->reward_seq);
+    free(mc->action_seq);
+}
+
+// Channels change at 1/3 and 2/3 of the slots
+static void change_channels(void *arg, struct snc_engine *eng)
+{
+    struct nonstationary *ns = arg;
+    int t = eng->t;
+    if (t != ns->nslots/3 && t != 2 * ns->nslots/3)
+        return;
+    if (t == ns->nslots/3) {
+            pe = pe * 2;
+            ns->Tp = ns->Tp * 2;
+    }
+    if (t == 2 * ns->nslots /3) {
+            pe = pe / 4;
+            ns->Tp = ns->Tp / 4;
+    }
+    // modify channel parameters
+    printf("At time %d, channel paramters are changed\n", t);
+    for (int i=0; i<eng->cfg.nhop; i++)
+        ns->pe[i] = pe;
+    snc_modify_channels(eng, ns->Tp, ns->pe);
+}
+
 static int derive_action_id_from_policy(int r)
 {
     int x = rand() % 100000;
@@ -0,0 +1,289 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "engine.h"
+
+// Counters of the current batches, which are shared with the codec and the learning functions
+int currbatch = 0;
+// encoder
+int batchsent = 0;              // number of packets sent from the current batch
+// recoder
+int s_count = 0;    // number of recoded packets sent from the current batc
+// decoder
+int batchcount = 0;   // number of received packets of the current receiving batch
+int dofcount = 0;     // number of innovative packets contributed by the current receiving batch
+
+static int create_nodes(struct snc_engine *eng);
+static void reset_nodes(struct snc_engine *eng);
+static void free_nodes(struct snc_engine *eng);
+static void reset_counters(void);
+
+struct snc_engine *snc_create_engine(const struct snc_config *cfg, unsigned char *data,
+                                     const struct snc_policy *policy)
+{
+    static char fname[] = "snc_create_engine";
+    if (cfg->nhop < 1 || policy->first_batch == NULL || policy->next_batch == NULL) {
+        fprintf(stderr, "%s: invalid number of hops or policy\n", fname);
+        return NULL;
+    }
+    struct snc_engine *eng = calloc(1, sizeof(struct snc_engine));
+    if (eng == NULL) {
+        fprintf(stderr, "%s: malloc failed\n", fname);
+        return NULL;
+    }
+    eng->cfg     = *cfg;
+    eng->data    = data;
+    eng->policy  = *policy;
+    eng->on_slot = NULL;
+    eng->t       = 0;
+    eng->episode = 0;
+    return eng;
+}
+
+void snc_free_engine(struct snc_engine *eng)
+{
+    if (eng == NULL)
+        return;
+    free_nodes(eng);
+    free(eng);
+}
+
+int snc_start_episode(struct snc_engine *eng)
+{
+    static char fname[] = "snc_start_episode";
+    eng->episode += 1;
+    eng->nuse = 0;
+    eng->identical = 0;
+    // nodes and channels of the first episode are reused by the following ones
+    if (eng->encoder == NULL) {
+        if (create_nodes(eng) < 0)
+            goto AllocError;
+    } else {
+        reset_nodes(eng);
+    }
+
+    // create first batch
+    int deg, bts;
+    eng->policy.first_batch(eng->policy.ctx, eng, &deg, &bts);
+    bats_start_new_batch(eng->encoder, currbatch, deg, bts);
+
+    // simulate the line network by events
+    if (eng->net != NULL) {
+        reset_line_network(eng->net);
+        return 0;
+    }
+    eng->net = create_line_network(eng->cfg.nhop, eng->encoder, eng->buf, &eng->decoder, eng->chnl, eng->fdbk);
+    if (eng->net == NULL)
+        goto AllocError;
+    return 0;
+
+AllocError:
+    fprintf(stderr, "%s: failed to set up episode %d\n", fname, eng->episode);
+    free_nodes(eng);
+    return -1;
+}
+
+int snc_step(struct snc_engine *eng)
+{
+    if (eng->on_slot != NULL)
+        eng->on_slot(eng->on_slot_arg, eng);
+    // use each forward hop once, and feed back the DoF of the decoder
+    run_network_slot(eng->net);
+
+    // check whether it's time to change a batch
+    BATSencoder *encoder = eng->encoder;
+    int finished = eng->decoder.ops->finished(eng->decoder.ctx);
+    if (batchsent >= encoder->currbat->bts || finished) {
+        int deg = encoder->currbat->degree;
+        int bts = encoder->currbat->bts;
+        eng->policy.next_batch(eng->policy.ctx, eng, &deg, &bts);
+        // Start next batch if the episode is not yet complete
+        if (!finished) {
+            currbatch++;
+            bats_start_new_batch(encoder, currbatch, deg, bts);
+        }
+        reset_counters();
+    }
+    eng->t++;
+    eng->nuse++;
+    batchsent++;
+
+    if (finished) {
+        eng->identical = 1;
+        GF_ELEMENT **pp = eng->decoder.ops->packets(eng->decoder.ctx);
+        for (int i=0; eng->param.pktsize!=0 && i<eng->param.snum; i++) {
+            if (memcmp(encoder->pp[i], pp[i], eng->param.pktsize) != 0) {
+                fprintf(stderr, "recovered is NOT identical to original.\n");
+                eng->identical = 0;
+                break;
+            }
+        }
+    }
+    return finished;
+}
+
+void snc_end_episode(struct snc_engine *eng)
+{
+    if (eng->policy.episode_done != NULL)
+        eng->policy.episode_done(eng->policy.ctx, eng);
+    currbatch = 0;
+    reset_counters();
+}
+
+void snc_modify_channels(struct snc_engine *eng, int Tp, const double *pe)
+{
+    double fb_succ = 1.0;
+    for (int i=0; i<eng->cfg.nhop; i++) {
+        modify_channel(eng->chnl[i], Tp, pe[i]);
+        fb_succ *= (1-pe[i]);
+    }
+    // perfect feedback is unchanged
+    if (eng->cfg.feedback == SNC_FEEDBACK)
+        modify_channel(eng->fdbk, Tp * eng->cfg.nhop, 1-fb_succ);
+}
+
+int snc_decoder_from_env(void)
+{
+    static char fname[] = "snc_decoder_from_env";
+    char *name = getenv("BATS_DECODER");
+    if (name == NULL || strcmp(name, "ref") == 0)
+        return SNC_DECODER_REF;
+    if (strcmp(name, "bp") == 0)
+        return SNC_DECODER_BP;
+    if (strcmp(name, "inac") == 0)
+        return SNC_DECODER_INAC;
+    fprintf(stderr, "%s: unknown decoder %s, the reference decoder is used\n", fname, name);
+    return SNC_DECODER_REF;
+}
+
+void snc_fixed_batch(void *ctx, struct snc_engine *eng, int *deg, int *bts)
+{
+    *deg = ((int *) ctx)[0];
+    *bts = ((int *) ctx)[1];
+}
+
+// Create the nodes and channels of the first episode
+static int create_nodes(struct snc_engine *eng)
+{
+    struct snc_config *cfg = &eng->cfg;
+    int i;
+    BATSparam param = { cfg->snum * cfg->pktsize,
+                        cfg->snum,      // number of source packets, derived from datasize if pktsize != 0
+                        cfg->cnum,      // parity-check packets
+                        cfg->pktsize,
+                        0,              // seed for RNG
+                        cfg->hnum,      // HDPC packets
+                    };
+    eng->param = param;
+    // create encoder at source node
+    if ((eng->encoder = bats_create_encoder(eng->data, &eng->param)) == NULL)
+        goto AllocError;
+    // create recoders at intermediate nodes
+    if ((eng->buf = calloc(cfg->nhop-1 > 0 ? cfg->nhop-1 : 1, sizeof(BATSbuffer*))) == NULL)
+        goto AllocError;
+    for (i=0; i<cfg->nhop-1; i++) {
+        if ((eng->buf[i] = bats_create_buffer(&eng->param, cfg->bufsize)) == NULL)
+            goto AllocError;
+    }
+    // create decoder at destination node
+    if (cfg->decoder == SNC_DECODER_BP) {
+        eng->decoder.ctx = bats_create_decoder_bp(&eng->param);
+        eng->decoder.ops = &bats_decoder_bp_ops;
+    } else if (cfg->decoder == SNC_DECODER_INAC) {
+        eng->decoder.ctx = bats_create_decoder_inac(&eng->param);
+        eng->decoder.ops = &bats_decoder_bp_ops;
+    } else {
+        eng->decoder.ctx = bats_create_decoder_ref(&eng->param);
+        eng->decoder.ops = &bats_decoder_ref_ops;
+    }
+    if (eng->decoder.ctx == NULL)
+        goto AllocError;
+
+    // create forward channels
+    if ((eng->chnl = calloc(cfg->nhop, sizeof(struct channel*))) == NULL)
+        goto AllocError;
+    double fb_succ = 1.0;
+    int Tfb = 0;                    // delay of the feedback, through all the hops
+    int maxTp = cfg->maxTp > cfg->Tp ? cfg->maxTp : cfg->Tp;
+    for (i=0; i<cfg->nhop; i++) {
+        int delay = hop_delay_from_env(i, cfg->Tp);
+        if ((eng->chnl[i] = create_channel(cfg->Tp, delay > maxTp ? delay : maxTp, cfg->pe)) == NULL)
+            goto AllocError;
+        set_channel_release(eng->chnl[i], bats_release_packet);
+        set_channel_from_env(eng->chnl[i]);  // burst losses or trace replay if set by environment variables
+        set_hop_from_env(eng->chnl[i], i);   // delay, rate and queue of the hop if set by environment variables
+        fb_succ *= (1-cfg->pe);
+        Tfb += eng->chnl[i]->delay;
+    }
+    // create effective feedback channel (note multihop relay)
+    if (cfg->feedback == SNC_PERFECT_FEEDBACK) {
+        eng->fdbk = create_channel(0, 0, 0);
+    } else if (cfg->feedback == SNC_FEEDBACK) {
+        eng->fdbk = create_channel(Tfb, maxTp * cfg->nhop, 1-fb_succ);
+    } else {
+        eng->fdbk = NULL;
+    }
+    if (cfg->feedback != SNC_NO_FEEDBACK && eng->fdbk == NULL)
+        goto AllocError;
+
+    return 0;
+
+AllocError:
+    return -1;
+}
+
+// Restore the nodes and channels for another episode, in the order they are created, so that the
+// episode draws the same random numbers as if they were created again
+static void reset_nodes(struct snc_engine *eng)
+{
+    int i;
+    bats_reset_encoder(eng->encoder);
+    for (i=0; i<eng->cfg.nhop-1; i++)
+        bats_reset_buffer(eng->buf[i]);
+    eng->decoder.ops->reset(eng->decoder.ctx);
+    for (i=0; i<eng->cfg.nhop; i++)
+        reset_channel(eng->chnl[i]);
+    if (eng->fdbk != NULL)
+        reset_channel(eng->fdbk);
+}
+
+static void free_nodes(struct snc_engine *eng)
+{
+    int i;
+    // free network before the nodes, as it frees the packets in flight
+    free_line_network(eng->net);
+    eng->net = NULL;
+    // free encoder
+    if (eng->encoder != NULL)
+        bats_free_encoder(eng->encoder);
+    eng->encoder = NULL;
+    // free recoder buffers
+    for (i=0; eng->buf!=NULL && i<eng->cfg.nhop-1; i++) {
+        if (eng->buf[i] != NULL)
+            bats_free_buffer(eng->buf[i]);
+    }
+    free(eng->buf);
+    eng->buf = NULL;
+    // free decoder
+    if (eng->decoder.ctx != NULL)
+        eng->decoder.ops->free(eng->decoder.ctx);
+    eng->decoder.ctx = NULL;
+    // free channels
+    for (i=0; eng->chnl!=NULL && i<eng->cfg.nhop; i++) {
+        if (eng->chnl[i] != NULL)
+            free_channel(eng->chnl[i]);
+    }
+    free(eng->chnl);
+    eng->chnl = NULL;
+    if (eng->fdbk != NULL)
+        free_channel(eng->fdbk);
+    eng->fdbk = NULL;
+}
+
+static void reset_counters(void)
+{
+    batchsent = 0;
+    batchcount = 0;
+    dofcount = 0;
+    s_count = 0;
+}
@@ -0,0 +1,104 @@
+#ifndef ENGINE_H
+#define ENGINE_H
+#include "bats.h"
+#include "channel.h"
+#include "network.h"
+
+/*
+ * Simulation engine of BATS codes over line networks
+ *
+ * An episode sends a file from the source to the destination over nhop hops, until the
+ * destination decodes it. The engine simulates an episode slot by slot with snc_step(), and
+ * asks a batch-selection policy for the degree and BTS of each batch, so that static and
+ * learnt batch sizes run on the same engine:
+ *
+ *   struct snc_engine *eng = snc_create_engine(&cfg, data, &policy);
+ *   while (eng->t < nslots) {
+ *       snc_start_episode(eng);
+ *       while (!snc_step(eng))
+ *           ;
+ *       snc_end_episode(eng);
+ *   }
+ *   snc_free_engine(eng);
+ *
+ * The nodes and channels are created in the first episode, and are reset in place for the
+ * following ones, so episodes don't pay for allocating them and precoding the source data again.
+ * Changes of the channels by snc_modify_channels() are kept by the following episodes. The
+ * channels of the hops are further set by the environment variables of channel.h and network.h.
+ */
+
+#define SNC_NO_FEEDBACK         0   // the destination doesn't feed back
+#define SNC_FEEDBACK            1   // feedback is relayed back through the hops
+#define SNC_PERFECT_FEEDBACK    2   // feedback arrives at once and is never lost
+
+#define SNC_DECODER_REF         0   // reference decoder by Gaussian elimination
+#define SNC_DECODER_BP          1   // belief-propagation decoder
+#define SNC_DECODER_INAC        2   // inactivation decoder
+
+struct snc_config {
+    int     snum;           // number of source packets
+    int     cnum;           // number of parity-check packets of the precode
+    int     hnum;           // number of HDPC packets of the precode
+    int     pktsize;        // packet size, 0 to simulate ranks only
+    int     bufsize;        // size of the recoding buffers of the relays
+    int     nhop;           // number of hops
+    int     Tp;             // propagation delay of each hop
+    int     maxTp;          // largest Tp given to snc_modify_channels(), which channels are sized for
+    double  pe;             // erasure probability of each hop
+    int     feedback;       // how the DoF of the destination is fed back to the source
+    int     decoder;        // decoder of the destination, SNC_DECODER_*
+};
+
+struct snc_engine;
+
+// Batch-selection policy of the source
+struct snc_policy {
+    void    *ctx;
+    // Choose the degree and BTS of the first batch of an episode
+    void    (*first_batch)(void *ctx, struct snc_engine *eng, int *deg, int *bts);
+    // The current batch is done, choose the degree and BTS of the next batch. It's also called
+    // for the last batch of the episode, when the decoder has finished.
+    void    (*next_batch)(void *ctx, struct snc_engine *eng, int *deg, int *bts);
+    // The episode is done, which may be NULL
+    void    (*episode_done)(void *ctx, struct snc_engine *eng);
+};
+
+struct snc_engine {
+    struct snc_config       cfg;
+    unsigned char           *data;      // source data of snum*pktsize bytes, owned by the caller
+    struct snc_policy       policy;
+    // called at the beginning of each slot, e.g., to change the channels
+    void                    (*on_slot)(void *arg, struct snc_engine *eng);
+    void                    *on_slot_arg;
+    int                     t;          // time slots simulated in all episodes
+    int                     episode;    // number of episodes started
+    // nodes and channels of the current episode
+    BATSparam               param;
+    BATSencoder             *encoder;
+    BATSbuffer              **buf;
+    struct bats_decoder     decoder;    // ctx is NULL before the first episode
+    struct channel          **chnl;
+    struct channel          *fdbk;
+    struct line_network     *net;
+    int                     nuse;       // network uses of the current episode
+    int                     identical;  // whether the decoded packets are identical to the source
+};
+
+struct snc_engine *snc_create_engine(const struct snc_config *cfg, unsigned char *data,
+                                     const struct snc_policy *policy);
+void snc_free_engine(struct snc_engine *eng);
+// Set up the nodes and channels of a new episode, or reset those of the last one, and start its
+// first batch
+int snc_start_episode(struct snc_engine *eng);
+// Simulate a slot of the episode, and return 1 if the destination has decoded
+int snc_step(struct snc_engine *eng);
+// The nodes and channels are kept for the next episode until snc_free_engine()
+void snc_end_episode(struct snc_engine *eng);
+// Change the delay and erasure probabilities of the hops from the current slot, and the
+// feedback channel accordingly
+void snc_modify_channels(struct snc_engine *eng, int Tp, const double *pe);
+// Decoder given by BATS_DECODER="ref", "bp" or "inac", or the reference decoder if it isn't set
+int snc_decoder_from_env(void);
+// Policy of batches of a fixed degree and BTS, where ctx points to int[2] of them
+void snc_fixed_batch(void *ctx, struct snc_engine *eng, int *deg, int *bts);
+#endif
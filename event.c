@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "event.h"
+
+#define WHEEL_MIN   64      // minimum number of slots of the wheel
+
+static int reserve_wheel(struct event_queue *eq, int span);
+
+// Create an event queue for events up to span slots ahead. It grows for events further ahead.
+struct event_queue *create_event_queue(int span)
+{
+    static char fname[] = "create_event_queue";
+    struct event_queue *eq = calloc(1, sizeof(struct event_queue));
+    if (eq == NULL) {
+        fprintf(stderr, "%s: malloc failed\n", fname);
+        return NULL;
+    }
+    if (reserve_wheel(eq, span) < 0) {
+        free(eq);
+        return NULL;
+    }
+    return eq;
+}
+
+void free_event_queue(struct event_queue *eq)
+{
+    if (eq == NULL)
+        return;
+    for (int i=0; i<eq->nslot; i++)
+        free(eq->wheel[i].ev);
+    free(eq->wheel);
+    free(eq);
+}
+
+// Drop the events and restart the queue from time 0, keeping the wheel and its buckets
+void reset_event_queue(struct event_queue *eq)
+{
+    for (int i=0; i<eq->nslot && eq->size>0; i++) {
+        eq->size -= eq->wheel[i].len - eq->wheel[i].head;
+        eq->wheel[i].head = eq->wheel[i].len = 0;
+    }
+    eq->now  = 0;
+    eq->size = 0;
+}
+
+int schedule_event(struct event_queue *eq, const struct event *ev)
+{
+    struct event e = *ev;
+    if (e.time < eq->now)
+        e.time = eq->now;           // the past cannot be changed, happen as soon as possible
+    if (e.time - eq->now >= eq->nslot && reserve_wheel(eq, e.time - eq->now) < 0)
+        return -1;
+    struct event_bucket *b = &eq->wheel[e.time & (eq->nslot-1)];
+    if (b->len == b->cap) {
+        if (b->head > 0) {
+            // reuse the room of events which have happened
+            memmove(b->ev, &b->ev[b->head], (b->len - b->head) * sizeof(struct event));
+            b->len -= b->head;
+            b->head = 0;
+        } else {
+            int cap = b->cap > 0 ? b->cap * 2 : 8;
+            struct event *evs = realloc(b->ev, cap * sizeof(struct event));
+            if (evs == NULL) {
+                fprintf(stderr, "schedule_event: realloc event bucket failed\n");
+                return -1;
+            }
+            b->ev  = evs;
+            b->cap = cap;
+        }
+    }
+    // events are mostly scheduled in their order, so they are inserted from the back
+    int i = b->len;
+    while (i > b->head && b->ev[i-1].order > e.order) {
+        b->ev[i] = b->ev[i-1];
+        i--;
+    }
+    b->ev[i] = e;
+    b->len += 1;
+    eq->size += 1;
+    return 0;
+}
+
+int next_event(struct event_queue *eq, int time, struct event *ev)
+{
+    if (eq->size == 0)
+        return 0;
+    struct event_bucket *b = &eq->wheel[eq->now & (eq->nslot-1)];
+    while (b->head == b->len) {
+        if (eq->now >= time)
+            return 0;
+        eq->now += 1;
+        b = &eq->wheel[eq->now & (eq->nslot-1)];
+    }
+    if (eq->now > time)
+        return 0;
+    *ev = b->ev[b->head++];
+    if (b->head == b->len)
+        b->head = b->len = 0;
+    eq->size -= 1;
+    return 1;
+}
+
+// Make the wheel longer than span. Events of a bucket are of the same slot, so the buckets
+// are moved as a whole to the longer wheel.
+static int reserve_wheel(struct event_queue *eq, int span)
+{
+    if (span < eq->nslot)
+        return 0;
+    int nslot = eq->nslot > 0 ? eq->nslot : WHEEL_MIN;
+    while (nslot <= span)
+        nslot *= 2;
+    struct event_bucket *wheel = calloc(nslot, sizeof(struct event_bucket));
+    if (wheel == NULL) {
+        fprintf(stderr, "reserve_wheel: calloc timer wheel failed\n");
+        return -1;
+    }
+    for (int i=0; i<eq->nslot; i++) {
+        struct event_bucket *b = &eq->wheel[i];
+        if (b->head < b->len)
+            wheel[b->ev[b->head].time & (nslot-1)] = *b;
+        else
+            free(b->ev);
+    }
+    free(eq->wheel);
+    eq->wheel = wheel;
+    eq->nslot = nslot;
+    return 0;
+}
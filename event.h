@@ -0,0 +1,46 @@
+#ifndef EVENT_H
+#define EVENT_H
+#include <stdint.h>
+
+/*
+ * Event queue of discrete-event simulations
+ * Implemented as a timer wheel, which has a bucket of events for each time slot. Events of a
+ * slot happen in the given order, and those of the same order are first-in first-out. The
+ * wheel is longer than the time span of the scheduled events, so a bucket only holds events
+ * of one slot, and it's doubled when an event is scheduled beyond it.
+ */
+
+struct event {
+    int         time;       // time slot when the event happens
+    int         order;      // order of the event in the time slot
+    int         type;
+    int         node;       // node or hop where the event happens
+    int         value;
+    void        *packet;    // packet carried by the event, owned by the event queue
+};
+
+// Events of a time slot, sorted by order. Events before head have happened.
+struct event_bucket {
+    struct event *ev;
+    int         head;
+    int         len;
+    int         cap;
+};
+
+struct event_queue {
+    struct event_bucket *wheel; // events of time t are in wheel[t % nslot]
+    int         nslot;          // power of two
+    int         now;            // no event is earlier than now
+    int         size;           // number of events scheduled
+};
+
+struct event_queue *create_event_queue(int span);
+// Packets still carried by events are not freed, see next_event() to drain the queue
+void free_event_queue(struct event_queue *eq);
+// Restart the queue from time 0 without events. Packets carried by the events are not freed either.
+void reset_event_queue(struct event_queue *eq);
+// Schedule a copy of the event, return -1 if the queue cannot grow
+int schedule_event(struct event_queue *eq, const struct event *ev);
+// Pop the earliest event into ev if it happens no later than time, return 0 if there is none
+int next_event(struct event_queue *eq, int time, struct event *ev);
+#endif
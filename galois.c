@@ -392,3 +392,84 @@ void galois_multiply_region(uint8_t *src, uint8_t multiplier, int bytes)
     return;
 #endif
 }
+
+/*
+ * Zero tests of regions. When SSE/AVX2 is enabled, 16/32 elements are compared
+ * with zero at a time, and the comparison results are collected as bit masks.
+ */
+// index of the first nonzero element, or bytes if all are zero
+int galois_first_nonzero(uint8_t *src, int bytes)
+{
+    int i = 0;
+#if defined(INTEL_AVX2)
+    __m256i zero2 = _mm256_setzero_si256();
+    for (; i+32<=bytes; i+=32) {
+        uint32_t mask = ~(uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i *)(src+i)), zero2));
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
+    }
+#endif
+#if defined(INTEL_SSSE3)
+    __m128i zero = _mm_setzero_si128();
+    for (; i+16<=bytes; i+=16) {
+        uint32_t mask = ~(uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((__m128i *)(src+i)), zero)) & 0xffff;
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
+    }
+#endif
+    for (; i<bytes; i++) {
+        if (src[i] != 0)
+            return i;
+    }
+    return bytes;
+}
+
+// index of the last nonzero element, or -1 if all are zero
+int galois_last_nonzero(uint8_t *src, int bytes)
+{
+    int i = bytes;
+#if defined(INTEL_AVX2)
+    __m256i zero2 = _mm256_setzero_si256();
+    for (; i>=32; i-=32) {
+        uint32_t mask = ~(uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i *)(src+i-32)), zero2));
+        if (mask != 0)
+            return i - 1 - __builtin_clz(mask);
+    }
+#endif
+#if defined(INTEL_SSSE3)
+    __m128i zero = _mm_setzero_si128();
+    for (; i>=16; i-=16) {
+        uint32_t mask = ~(uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((__m128i *)(src+i-16)), zero)) & 0xffff;
+        if (mask != 0)
+            return i - 16 + 31 - __builtin_clz(mask);
+    }
+#endif
+    for (i=i-1; i>=0; i--) {
+        if (src[i] != 0)
+            return i;
+    }
+    return -1;
+}
+
+int galois_count_nonzeros(uint8_t *src, int bytes)
+{
+    int i = 0;
+    int nz = 0;
+#if defined(INTEL_AVX2)
+    __m256i zero2 = _mm256_setzero_si256();
+    for (; i+32<=bytes; i+=32) {
+        uint32_t mask = ~(uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i *)(src+i)), zero2));
+        nz += __builtin_popcount(mask);
+    }
+#endif
+#if defined(INTEL_SSSE3)
+    __m128i zero = _mm_setzero_si128();
+    for (; i+16<=bytes; i+=16) {
+        uint32_t mask = ~(uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((__m128i *)(src+i)), zero)) & 0xffff;
+        nz += __builtin_popcount(mask);
+    }
+#endif
+    for (; i<bytes; i++)
+        nz += src[i] != 0;
+    return nz;
+}
@@ -21,4 +21,7 @@ uint8_t galois_multiply(uint8_t a, uint8_t b);
 uint8_t galois_divide(uint8_t a, uint8_t b);
 void galois_multiply_region(uint8_t *src, uint8_t multiplier, int bytes);
 void galois_multiply_add_region(uint8_t *dst, uint8_t *src, uint8_t multiplier, int bytes);
+int galois_first_nonzero(uint8_t *src, int bytes);
+int galois_last_nonzero(uint8_t *src, int bytes);
+int galois_count_nonzeros(uint8_t *src, int bytes);
 #endif
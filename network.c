@@ -0,0 +1,238 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "network.h"
+
+static void start_network(struct line_network *net);
+static void drain_events(struct line_network *net);
+static void wake_node(struct line_network *net, int node);
+static void send_packets(struct line_network *net, int node);
+static void transmit_packet(struct line_network *net, int hop, BATSpacket *pkt);
+static int hop_from_env(const char *name, int hop, double *value);
+static void receive_packet(struct line_network *net, int hop, BATSpacket *pkt);
+static void send_feedback(struct line_network *net);
+
+struct line_network *create_line_network(int nhop, BATSencoder *encoder, BATSbuffer **buf,
+                                         struct bats_decoder *decoder,
+                                         struct channel **chnl, struct channel *fdbk)
+{
+    static char fname[] = "create_line_network";
+    struct line_network *net = calloc(1, sizeof(struct line_network));
+    if (net == NULL)
+        goto AllocError;
+    net->nhop    = nhop;
+    net->now     = 0;
+    net->encoder = encoder;
+    net->buf     = buf;
+    net->decoder = decoder;
+    net->chnl    = chnl;
+    net->fdbk    = fdbk;
+    net->r_fb    = 0;
+    if ((net->awake = calloc(nhop, sizeof(int))) == NULL)
+        goto AllocError;
+    int span = fdbk != NULL ? fdbk->delay : 0;
+    for (int i=0; i<nhop; i++)
+        span = chnl[i]->delay > span ? chnl[i]->delay : span;
+    if ((net->eq = create_event_queue(span + 1)) == NULL)
+        goto AllocError;
+    start_network(net);
+    return net;
+
+AllocError:
+    fprintf(stderr, "%s: malloc failed\n", fname);
+    if (net != NULL)
+        free(net->awake);
+    free(net);
+    return NULL;
+}
+
+void reset_line_network(struct line_network *net)
+{
+    drain_events(net);
+    reset_event_queue(net->eq);
+    net->now  = 0;
+    net->r_fb = 0;
+    memset(net->awake, 0, net->nhop*sizeof(int));
+    start_network(net);
+}
+
+void free_line_network(struct line_network *net)
+{
+    if (net == NULL)
+        return;
+    drain_events(net);
+    free_event_queue(net->eq);
+    free(net->awake);
+    free(net);
+}
+
+void run_network_slot(struct line_network *net)
+{
+    struct event ev;
+    while (next_event(net->eq, net->now, &ev)) {
+        switch (ev.type) {
+            case EV_TX:
+                send_packets(net, ev.node);
+                break;
+            case EV_ARRIVAL:
+                receive_packet(net, ev.node, ev.packet);
+                break;
+            case EV_FEEDBACK:
+                send_feedback(net);
+                break;
+            case EV_FB_ARRIVAL:
+                net->r_fb = ev.value;         // update r knowledge at the sender
+                printf("Received feedback r = %d from decoder at time %d\n", ev.value, net->now);
+                break;
+        }
+    }
+    net->now++;
+}
+
+// Each of the variables is a comma-separated list of the hops. Hops not in the list are unchanged.
+void set_hop_from_env(struct channel *chnl, int hop)
+{
+    double delay, rate, qcap;
+    if (hop_from_env("HOP_DELAY", hop, &delay))
+        modify_channel(chnl, (int) delay, chnl->pe);
+    int hasrate = hop_from_env("HOP_RATE", hop, &rate);
+    int hasqcap = hop_from_env("HOP_QUEUE", hop, &qcap);
+    if (hasrate || hasqcap) {
+        if (!hasrate)
+            rate = (double) chnl->rate / RATE_ONE;
+        if (!hasqcap)
+            qcap = chnl->qcap;
+        set_channel_rate(chnl, rate, (int) qcap);
+    }
+}
+
+int hop_delay_from_env(int hop, int delay)
+{
+    double d;
+    return hop_from_env("HOP_DELAY", hop, &d) ? (int) d : delay;
+}
+
+// Value of the hop in the list of the variable, return 0 if there is none
+static int hop_from_env(const char *name, int hop, double *value)
+{
+    char *s = getenv(name);
+    for (int i=0; i<hop && s != NULL; i++) {
+        s = strchr(s, ',');
+        if (s != NULL)
+            s++;
+    }
+    if (s == NULL || *s == '\0' || *s == ',')
+        return 0;
+    char *end;
+    *value = strtod(s, &end);
+    if (end == s || *value < 0 || *value > INT_MAX/2) {
+        fprintf(stderr, "hop_from_env: bad %s \"%s\"\n", name, getenv(name));
+        return 0;
+    }
+    return 1;
+}
+
+// The source sends from the first slot, while the relays sleep until their first packet
+static void start_network(struct line_network *net)
+{
+    wake_node(net, 0);
+    if (net->fdbk != NULL) {
+        struct event ev = { 0, 2*net->nhop, EV_FEEDBACK, net->nhop, 0, NULL };
+        schedule_event(net->eq, &ev);
+    }
+}
+
+// Pop the remaining events and free the packets they carry
+static void drain_events(struct line_network *net)
+{
+    struct event ev;
+    while (next_event(net->eq, INT_MAX, &ev)) {
+        if (ev.packet != NULL)
+            bats_free_packet(ev.packet);
+    }
+}
+
+// Schedule the next transmission of a node in the current slot
+static void wake_node(struct line_network *net, int node)
+{
+    struct event ev = { net->now, 2*node, EV_TX, node, 0, NULL };
+    net->awake[node] = schedule_event(net->eq, &ev) == 0;
+}
+
+// The source offers a packet in every slot, which waits in the queue of the link if the link
+// cannot send it yet. A relay recodes as many packets as its link can send.
+static void send_packets(struct line_network *net, int node)
+{
+    struct channel *chnl = net->chnl[node];
+    BATSpacket *fresh = node == 0 ? bats_encode_packet(net->encoder) : NULL;
+    int idle = 0;       // whether a relay has nothing to recode
+    while (channel_credit(chnl, net->now) > 0) {
+        BATSpacket *pkt = dequeue_from_channel(chnl);
+        if (pkt == NULL && fresh != NULL) {
+            pkt = fresh;
+            fresh = NULL;
+        }
+        if (pkt == NULL && node > 0)
+            pkt = bats_recode_packet(net->buf[node-1]);
+        if (pkt == NULL) {
+            idle = node > 0;
+            break;
+        }
+        spend_channel_credit(chnl);
+        transmit_packet(net, node, pkt);
+    }
+    if (fresh != NULL && enqueue_to_channel(chnl, fresh)) {
+        bats_free_packet(fresh);
+        printf("Packet sent on hop %d at time %d is dropped by the full queue\n", node, net->now);
+    }
+    if (idle) {
+        net->awake[node] = 0;       // sleep until the next packet arrives
+        return;
+    }
+    // the source sends in every slot, while a relay waits for the credit of its link
+    int next = node == 0 ? net->now+1 : channel_credit_time(chnl, net->now+1);
+    struct event ev = { next, 2*node, EV_TX, node, 0, NULL };
+    net->awake[node] = schedule_event(net->eq, &ev) == 0;
+}
+
+static void transmit_packet(struct line_network *net, int hop, BATSpacket *pkt)
+{
+    int delay = channel_transit(net->chnl[hop]);
+    if (delay < 0) {
+        bats_free_packet(pkt);
+        printf("Packet sent on hop %d at time %d is lost\n", hop, net->now);
+        return;
+    }
+    struct event arrival = { net->now+delay, 2*hop+1, EV_ARRIVAL, hop, 0, pkt };
+    if (schedule_event(net->eq, &arrival) < 0)
+        bats_free_packet(pkt);
+}
+
+static void receive_packet(struct line_network *net, int hop, BATSpacket *pkt)
+{
+    if (hop < net->nhop-1) {
+        bats_buffer_packet(net->buf[hop], pkt);         // next node is an intermediate node
+        if (!net->awake[hop+1])
+            wake_node(net, hop+1);
+    } else {
+        struct bats_decoder *dec = net->decoder;       // next node is decoder
+        if (!dec->ops->finished(dec->ctx))
+            dec->ops->process(dec->ctx, pkt);
+        bats_free_packet(pkt);                          // decoder keeps its own copy
+    }
+}
+
+// Decoder feeds back its currently received DoF in every slot
+static void send_feedback(struct line_network *net)
+{
+    int r = net->decoder->ops->DoF(net->decoder->ctx);
+    printf("Decoder send feedback r = %d at time %d\n", r, net->now);
+    int delay = channel_transit(net->fdbk);
+    if (delay >= 0) {
+        struct event arrival = { net->now+delay, 2*net->nhop+1, EV_FB_ARRIVAL, net->nhop, r, NULL };
+        schedule_event(net->eq, &arrival);
+    }
+    struct event ev = { net->now+1, 2*net->nhop, EV_FEEDBACK, net->nhop, 0, NULL };
+    schedule_event(net->eq, &ev);
+}
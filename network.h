@@ -0,0 +1,60 @@
+#ifndef NETWORK_H
+#define NETWORK_H
+#include "bats.h"
+#include "channel.h"
+#include "event.h"
+
+/*
+ * Line network of BATS nodes, simulated by discrete events
+ *
+ * S ---chnl[0]---> V1 ---chnl[1]---> ... ---chnl[nhop-1]---> D
+ * D ---------------------fdbk------------------------------> S
+ *
+ * Transmissions and arrivals of packets are events, so a slot only costs the packets sent and
+ * received in it. A relay sleeps until it has a packet to recode, and packets in flight wait in
+ * the event queue rather than being polled from the channels, so hops of different delays cost
+ * the same as hops of equal delays.
+ *
+ * The hops send packets at the rates of their links. The source offers a packet per slot, which
+ * waits in the queue of the first link if it cannot be sent yet, and the relays recode as many
+ * packets as their links can send.
+ */
+
+// Events, in their order in a time slot on hop i
+#define EV_TX           0   // node i sends packets on hop i, order 2i
+#define EV_ARRIVAL      1   // packet of hop i arrives at node i+1, order 2i+1
+#define EV_FEEDBACK     2   // destination feeds back its DoF, order 2nhop
+#define EV_FB_ARRIVAL   3   // feedback arrives at the source, order 2nhop+1
+
+struct line_network {
+    int                     nhop;
+    int                     now;        // current time slot
+    BATSencoder             *encoder;   // source node
+    BATSbuffer              **buf;      // recoders of the nhop-1 relays
+    struct bats_decoder     *decoder;   // destination node
+    struct channel          **chnl;     // forward channels of the hops
+    struct channel          *fdbk;      // feedback channel, NULL if there is no feedback
+    int                     r_fb;       // latest DoF of the decoder known at the source
+    int                     *awake;     // whether node i has its next transmission scheduled
+    struct event_queue      *eq;
+};
+
+// The network refers to the nodes and channels, which are still owned by the caller
+struct line_network *create_line_network(int nhop, BATSencoder *encoder, BATSbuffer **buf,
+                                         struct bats_decoder *decoder,
+                                         struct channel **chnl, struct channel *fdbk);
+// Restart the network from time 0 and free the packets in flight, after the nodes and channels
+// have been reset for another episode
+void reset_line_network(struct line_network *net);
+// Free the network and the packets still in flight
+void free_line_network(struct line_network *net);
+// Run the events of the current time slot, and advance to the next slot
+void run_network_slot(struct line_network *net);
+// Set the channel of a hop by environment variables, if any of them is set:
+//   HOP_DELAY="d1,d2,...", delays of the hops in slots
+//   HOP_RATE="r1,r2,...", packets per slot the hops can send, which may be fractional
+//   HOP_QUEUE="q1,q2,...", number of packets waiting in the drop-tail queues of the hops
+void set_hop_from_env(struct channel *chnl, int hop);
+// Delay of the hop given by HOP_DELAY, or delay if there is none
+int hop_delay_from_env(int hop, int delay);
+#endif
@@ -6,18 +6,16 @@
 #include <unistd.h>
 #include <fcntl.h>
 
-#include "bats.h"
-#include "channel.h"
+#include "engine.h"
 
-int currbatch = 0;
-// encoder
-int batchsent = 0;              // number of packets sent from the current batch
-// recoder
-int s_count = 0;    // number of recoded packets sent from the current batc
-// decoder
-int batchcount = 0;   // number of received packets of the current receiving batch
-int dofcount = 0;     // number of innovative packets contributed by the current receiving batch
+// Channels of the hops if NONSTATIONARY is set
+struct nonstationary {
+    int     nslots;
+    int     Tp;
+    double  *pe;
+};
 
+static void change_channels(void *arg, struct snc_engine *eng);
 
 char usage[] = "Simulate n-hop lossy line networks\n\
                 \n\
@@ -39,7 +37,6 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
-    int i;
     // Network and coding parameters
     int nslots = atoi(argv[1]);
     int snum   = atoi(argv[2]);
@@ -50,7 +47,12 @@ int main(int argc, char *argv[])
     int nhop   = atoi(argv[7]);
     int Tp     = atoi(argv[8]);
     int bufsize = snum+cnum;
-    int pktsize = 256;
+    // Only ranks are simulated if RANK_ONLY is set, where packets carry no payload
+    int pktsize = getenv("RANK_ONLY") != NULL ? 0 : 256;
+    // Number of HDPC packets of the precode, given by HDPC
+    int hnum = getenv("HDPC") != NULL ? atoi(getenv("HDPC")) : 0;
+    // Decoder of the destination, given by BATS_DECODER="ref", "bp" or "inac"
+    int dectype = snc_decoder_from_env();
     int datasize = snum * pktsize;
     
     struct timeval tv;
@@ -62,147 +64,59 @@ int main(int argc, char *argv[])
     int rnd=open("/dev/urandom", O_RDONLY);
     read(rnd, databuf, datasize);
     close(rnd);
-    int t = 0;
-    while (t < nslots) {
-        BATSparam param = { datasize,
-                            0,              // no need to specify number of source packets
-                            cnum,           // parity-check packets
-                            pktsize,
-                            0,              // seed for RNG
-                        };
-        // create encoder at source node
-        BATSencoder *encoder = bats_create_encoder(databuf, &param);
-        // create recoders at intermediate nodes
-        BATSbuffer **buf = calloc(nhop-1, sizeof(BATSbuffer*));
-        for (i=0; i<nhop-1; i++)
-            buf[i] = bats_create_buffer(&param, bufsize);
-        // create decoder at destination node
-        struct bats_decoder_ref *decoder = bats_create_decoder_ref(&param);
 
-        // create forward channels
-        struct channel **chnl = calloc(nhop, sizeof(struct chnl*));
-        for (i=0; i<nhop; i++) {
-            chnl[i] = create_channel(Tp, pe);
-        }
-
-        BATSpacket *pkt;
-        int nuse = 0;                   // number of network uses
-        // create new batch
-        bats_start_new_batch(encoder, currbatch, deg, bts);
-
-        while (!decoder->finished) {
-            // change channel paramter if an environment argument is set
-            if (t== nslots/3 || t == 2 * nslots/3) {
-                char *changing = getenv("NONSTATIONARY");
-                if (changing != NULL && strcmp(changing, "TRUE") == 0) {
-                    if (t == nslots/3) {
-                            pe = pe * 2;
-                            Tp = Tp * 2;
-                            // modify channel parameters
-                            printf("At time %d, channel paramters are changed\n", t);
-                            for (i=0; i<nhop; i++) {
-                                modify_channel(chnl[i], t, Tp, pe);
-                            }
-                    }
-                    if (t == 2 * nslots /3) {
-                            pe = pe / 4;
-                            Tp = Tp / 4;
-                            // modify channel parameters
-                            printf("At time %d, channel paramters are changed\n", t);
-                            for (i=0; i<nhop; i++) {
-                                modify_channel(chnl[i], t, Tp, pe);
-                            }
-                    }
-                }
-            }
-            // use each forward hop once
-            for (int i=0; i<nhop; i++) {
-                // first hop
-                if (i == 0) {
-                    pkt = bats_encode_packet(encoder);
-                } else {
-                    pkt = bats_recode_packet(buf[i-1]);
-                    if (pkt == NULL) {
-                        continue;
-                    }
-                }
-                // send to channel of hop i
-                int lost = send_to_channel(chnl[i], pkt, nuse);
-                if (lost) {
-                    bats_free_packet(pkt);
-                    pkt = NULL;
-                    printf("Packet sent on hop %d at time %d is lost\n", i, nuse);
-                }
-                // receive from channel of hop i
-                BATSpacket *rpkt = (BATSpacket*) recv_from_channel(chnl[i], nuse);
-                if (rpkt != NULL) {
-                    if (i < nhop-1) {
-                        bats_buffer_packet(buf[i], rpkt);        // next node is an intermediate node
-                    } else {
-                        bats_process_packet_ref(decoder, rpkt);  // next node is decoder
-                    }
-                } else {
-                    printf("Receive NULL from channel of hop %d at time %d\n", i, nuse);
-                }
-            }
+    // change_channels() doubles Tp at 1/3 of the slots
+    struct snc_config cfg = { snum, cnum, hnum, pktsize, bufsize, nhop, Tp, 2*Tp, pe, SNC_NO_FEEDBACK, dectype };
+    int batch[2] = { deg, bts };
+    struct snc_policy policy = { batch, snc_fixed_batch, snc_fixed_batch, NULL };
+    struct snc_engine *eng = snc_create_engine(&cfg, databuf, &policy);
+    // change channel paramter if an environment argument is set
+    struct nonstationary ns = { nslots, Tp, calloc(nhop, sizeof(double)) };
+    ns.pe[0] = pe;
+    char *changing = getenv("NONSTATIONARY");
+    if (changing != NULL && strcmp(changing, "TRUE") == 0) {
+        eng->on_slot = change_channels;
+        eng->on_slot_arg = &ns;
+    }
 
-            // check whether it's time to change a batch
-            if (batchsent >= encoder->currbat->bts) {
-                currbatch++;
-                bats_start_new_batch(encoder, currbatch, deg, bts);
-                // reset batchsent
-                batchsent = 0;
-                batchcount = 0;
-                dofcount = 0;
-                s_count = 0;
-            }
-            t++;
-            nuse++;
-            batchsent++;
-        }
-        for (int i=0; i<param.snum; i++) {
-            if (memcmp(encoder->pp[i], decoder->pp[i], param.pktsize) != 0) {
-                fprintf(stderr, "recovered is NOT identical to original.\n");
-                break;
-            }
-        }
+    while (eng->t < nslots) {
+        if (snc_start_episode(eng) < 0)
+            break;
+        while (!snc_step(eng))
+            ;
 
         printf("bufsize: %d numhop: %d ", bufsize, nhop);
         printf("\n");
 
+        struct bats_decoder *decoder = &eng->decoder;
         printf("time: %d snum: %d cnum: %d pktsize: %d degree: %d bts: %d nbatch: %d overhead: %.4f ops: %.6f network-uses: %d \n", 
-                t, param.snum, param.cnum, param.pktsize, deg, bts, encoder->batnum, 
-                (double) decoder->overhead/decoder->param->snum, (double) decoder->operations/decoder->param->snum/decoder->param->pktsize, nuse);
-        // free memory allocation
-        // free encoder
-        bats_free_encoder(encoder);
-        encoder = NULL;
-        // free recoder buffers
-        for (i=0; i<nhop-1;i++) {
-            if (buf[i] != NULL) {
-                bats_free_buffer(buf[i]);
-                buf[i] = NULL;
-            }
-        }
-        free(buf);
-        buf = NULL;
-        // free decoder
-        bats_free_decoder_ref(decoder);
-        decoder = NULL;
-        currbatch = 0;
-        // free channel
-        for (i=0; i<nhop; i++) {
-            free_channel(chnl[i]);
-            chnl[i] = NULL;
-        }
-        // encoder
-        batchsent = 0;              // number of packets sent from the current batch
-        // recoder
-        s_count = 0;    // number of recoded packets sent from the current batc
-        // decoder
-        batchcount = 0;   // number of received packets of the current receiving batch
-        dofcount = 0;     // number of innovative packets contributed by the current receiving batch
+                eng->t, eng->param.snum, eng->param.cnum, eng->param.pktsize, deg, bts, eng->encoder->batnum, 
+                (double) decoder->ops->overhead(decoder->ctx)/eng->param.snum, (double) decoder->ops->operations(decoder->ctx)/eng->param.snum/(eng->param.pktsize != 0 ? eng->param.pktsize : 1), eng->nuse);
+        snc_end_episode(eng);
     }
+    snc_free_engine(eng);
+    free(ns.pe);
     free(databuf);
     return 0;
 }
+
+// Erasure probabilities and delays of the hops change at 1/3 and 2/3 of the slots
+static void change_channels(void *arg, struct snc_engine *eng)
+{
+    struct nonstationary *ns = arg;
+    int t = eng->t;
+    if (t != ns->nslots/3 && t != 2 * ns->nslots/3)
+        return;
+    if (t == ns->nslots/3) {
+            ns->pe[0] = ns->pe[0] * 2;
+            ns->Tp = ns->Tp * 2;
+    } else {
+            ns->pe[0] = ns->pe[0] / 4;
+            ns->Tp = ns->Tp / 4;
+    }
+    // modify channel parameters
+    printf("At time %d, channel paramters are changed\n", t);
+    for (int i=1; i<eng->cfg.nhop; i++)
+        ns->pe[i] = ns->pe[0];
+    snc_modify_channels(eng, ns->Tp, ns->pe);
+}
@@ -0,0 +1,63 @@
+// Convert a CSV capture of a link into the binary trace replayed by channels (see channel.h).
+// Each line of the CSV is one slot, given as "lost,delay", where lost is 0 or 1 and delay is the
+// delay in slots. Lines not starting with a digit (e.g. header, comments) are skipped.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "channel.h"
+
+char usage[] = "Convert CSV link capture to binary channel trace\n\
+                \n\
+                usage: ./trace-convert input.csv output.trace\n\
+                input.csv    - one slot per line, as lost,delay\n\
+                output.trace - binary trace for CHANNEL_TRACE\n";
+
+int main(int argc, char *argv[])
+{
+    static char fname[] = "trace-convert";
+    if (argc != 3) {
+        printf("%s\n", usage);
+        exit(1);
+    }
+    FILE *in = fopen(argv[1], "r");
+    FILE *out = fopen(argv[2], "wb");
+    if (in == NULL || out == NULL) {
+        fprintf(stderr, "%s: cannot open %s\n", fname, in == NULL ? argv[1] : argv[2]);
+        exit(1);
+    }
+    struct trace_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TRACE_MAGIC, 4);
+    hdr.version = TRACE_VERSION;
+    // header is rewritten once the records are counted
+    fwrite(&hdr, sizeof(hdr), 1, out);
+
+    char line[256];
+    long lineno = 0;
+    while (fgets(line, sizeof(line), in) != NULL) {
+        lineno++;
+        if (!isdigit((unsigned char) line[0]))
+            continue;
+        int lost, delay;
+        if (sscanf(line, "%d,%d", &lost, &delay) != 2 || delay < 0 || delay > TRACE_DELAY) {
+            fprintf(stderr, "%s: bad record at line %ld: %s", fname, lineno, line);
+            exit(1);
+        }
+        uint16_t r = (uint16_t) delay | (lost ? TRACE_LOST : 0);
+        fwrite(&r, sizeof(r), 1, out);
+        hdr.nslot += 1;
+        if (!lost && (uint32_t) delay > hdr.maxdelay)
+            hdr.maxdelay = delay;
+    }
+    rewind(out);
+    fwrite(&hdr, sizeof(hdr), 1, out);
+    if (fclose(out) != 0) {
+        fprintf(stderr, "%s: write %s failed\n", fname, argv[2]);
+        exit(1);
+    }
+    fclose(in);
+    printf("%llu slots, max delay %u\n", (unsigned long long) hdr.nslot, hdr.maxdelay);
+    return 0;
+}